@@ -0,0 +1,141 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <utility>
+#include "clusters.hpp"
+
+namespace
+{
+    // spreads the low 10 bits of v so there are two zero bits between each
+    uint32_t spread_bits(uint32_t v)
+    {
+        v &= 0x3ff;
+        v = (v | (v << 16)) & 0x030000ff;
+        v = (v | (v << 8)) & 0x0300f00f;
+        v = (v | (v << 4)) & 0x030c30c3;
+        v = (v | (v << 2)) & 0x09249249;
+        return v;
+    }
+
+    // 0..5 for the dominant axis and sign of the normal, 6 for degenerate triangles
+    uint64_t normal_bin(Vec3f n)
+    {
+        float ax = std::abs(n.x), ay = std::abs(n.y), az = std::abs(n.z);
+        if (ax == 0 && ay == 0 && az == 0)
+        {
+            return 6;
+        }
+        if (ax >= ay && ax >= az)
+        {
+            return n.x > 0 ? 0 : 1;
+        }
+        if (ay >= az)
+        {
+            return n.y > 0 ? 2 : 3;
+        }
+        return n.z > 0 ? 4 : 5;
+    }
+
+    MeshCluster make_cluster(Model &model, const std::vector<int> &triangles, const std::vector<Vec3f> &normals, int first, int count)
+    {
+        MeshCluster cluster;
+        cluster.first = first;
+        cluster.count = count;
+
+        Vec3f lo(model.max_x, model.max_y, model.max_z);
+        Vec3f hi(model.min_x, model.min_y, model.min_z);
+        Vec3f normal_sum;
+        bool degenerate = false;
+        for (int i = first; i < first + count; i++)
+        {
+            for (int v : model.face(triangles[i]))
+            {
+                Vec3f p = model.vert(v);
+                lo = Vec3f(std::min(lo.x, p.x), std::min(lo.y, p.y), std::min(lo.z, p.z));
+                hi = Vec3f(std::max(hi.x, p.x), std::max(hi.y, p.y), std::max(hi.z, p.z));
+            }
+            const Vec3f &n = normals[triangles[i]];
+            degenerate |= n.norm() == 0;
+            normal_sum = normal_sum + n;
+        }
+
+        cluster.center = (lo + hi) * 0.5f;
+        cluster.radius = 0;
+        for (int i = first; i < first + count; i++)
+        {
+            for (int v : model.face(triangles[i]))
+            {
+                cluster.radius = std::max(cluster.radius, (model.vert(v) - cluster.center).norm());
+            }
+        }
+
+        // the cone is only usable if every normal lies within 90 degrees of the axis
+        cluster.cone_axis = Vec3f(0, 0, 1);
+        cluster.cone_cutoff = 1;
+        if (!degenerate && normal_sum.norm() > 0)
+        {
+            cluster.cone_axis = normal_sum.normalize();
+            float min_dot = 1;
+            for (int i = first; i < first + count; i++)
+            {
+                min_dot = std::min(min_dot, normals[triangles[i]].dot(cluster.cone_axis));
+            }
+            if (min_dot > 0)
+            {
+                cluster.cone_cutoff = std::sqrt(1 - min_dot * min_dot);
+            }
+        }
+        return cluster;
+    }
+}
+
+uint32_t morton_code(Vec3f p, const Model &model)
+{
+    float ex = model.max_x - model.min_x;
+    float ey = model.max_y - model.min_y;
+    float ez = model.max_z - model.min_z;
+    uint32_t x = ex > 0 ? (uint32_t)std::min(1023.0f, std::max(0.0f, (p.x - model.min_x) / ex * 1024)) : 0;
+    uint32_t y = ey > 0 ? (uint32_t)std::min(1023.0f, std::max(0.0f, (p.y - model.min_y) / ey * 1024)) : 0;
+    uint32_t z = ez > 0 ? (uint32_t)std::min(1023.0f, std::max(0.0f, (p.z - model.min_z) / ez * 1024)) : 0;
+    return (spread_bits(x) << 2) | (spread_bits(y) << 1) | spread_bits(z);
+}
+
+MeshClusters build_clusters(Model &model, const MeshNormals &mesh_normals)
+{
+    MeshClusters result;
+
+    const std::vector<Vec3f> &normals = mesh_normals.faces;
+    // (normal bin, morton code) sort key and face index
+    std::vector<std::pair<uint64_t, int>> keys;
+    for (int i = 0; i < model.nfaces(); i++)
+    {
+        Triangle face = model.face(i);
+        Vec3f a = model.vert(face[0]);
+        Vec3f b = model.vert(face[1]);
+        Vec3f c = model.vert(face[2]);
+        Vec3f centroid = (a + b + c) * (1.0f / 3);
+        uint64_t key = (normal_bin(normals[i]) << 30) | morton_code(centroid, model);
+        keys.push_back(std::make_pair(key, i));
+    }
+    std::sort(keys.begin(), keys.end());
+
+    result.triangles.reserve(keys.size());
+    for (const std::pair<uint64_t, int> &key : keys)
+    {
+        result.triangles.push_back(key.second);
+    }
+
+    // cut runs of CLUSTER_TRIANGLES, starting a new cluster whenever the normal bin changes
+    size_t first = 0;
+    for (size_t i = 1; i <= keys.size(); i++)
+    {
+        bool bin_changed = i < keys.size() && (keys[i].first >> 30) != (keys[first].first >> 30);
+        if (i == keys.size() || bin_changed || i - first == CLUSTER_TRIANGLES)
+        {
+            std::sort(result.triangles.begin() + first, result.triangles.begin() + i);
+            result.clusters.push_back(make_cluster(model, result.triangles, normals, (int)first, (int)(i - first)));
+            first = i;
+        }
+    }
+    return result;
+}
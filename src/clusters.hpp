@@ -0,0 +1,53 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include "geometry.hpp"
+#include "model.hpp"
+#include "normals.hpp"
+
+// A group of up to CLUSTER_TRIANGLES nearby triangles facing roughly the same way.
+// Whole clusters are skipped per frame when they face away from the camera or fall
+// outside the frame, without touching their triangles.
+struct MeshCluster
+{
+    // range in MeshClusters::triangles
+    int first;
+    int count;
+    // bounding sphere of the cluster's vertices, in model space
+    Vec3f center;
+    float radius;
+    // every triangle normal n satisfies dot(n, cone_axis) >= sqrt(1 - cone_cutoff^2);
+    // cone_cutoff >= 1 means the normals spread too far for the cluster to be back-face culled
+    Vec3f cone_axis;
+    float cone_cutoff;
+};
+
+struct MeshClusters
+{
+    std::vector<MeshCluster> clusters;
+    // face indices of the model, grouped by cluster
+    std::vector<int> triangles;
+};
+
+const int CLUSTER_TRIANGLES = 64;
+
+// 30 bit Morton code of p within the model's bounds
+uint32_t morton_code(Vec3f p, const Model &model);
+
+// Groups the model's triangles into clusters. Triangles are binned by the dominant axis of
+// their normal, which keeps the normal cones narrow, then sorted along a Morton curve of
+// their centroids within each bin and cut into runs of CLUSTER_TRIANGLES. Within a cluster
+// triangles keep their order in the model, so a vertex cache order from reorder_model holds.
+MeshClusters build_clusters(Model &model, const MeshNormals &normals);
+
+// True if every triangle of the cluster faces away from a viewer at eye (model space).
+// Conservative: a cluster with any triangle possibly facing the eye is kept.
+inline bool cluster_backfacing(const MeshCluster &cluster, Vec3f eye)
+{
+    if (cluster.cone_cutoff >= 1)
+    {
+        return false;
+    }
+    Vec3f to_center = cluster.center - eye;
+    return to_center.dot(cluster.cone_axis) >= cluster.cone_cutoff * to_center.norm() + cluster.radius;
+}
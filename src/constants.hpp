@@ -1,4 +1,16 @@
 #pragma once
+#include <cstdint>
 
+// default output size
 const int WIDTH = 512;
-const int HEIGHT = 512;
\ No newline at end of file
+const int HEIGHT = 512;
+
+// largest render the pipeline can address: the gif encoder indexes pixels, their RGBA
+// copies and MSAA samples with 32-bit ints, so width * height * 4 must fit
+const int64_t MAX_PIXELS = (int64_t)1 << 28;
+const int MAX_FRAMES = 65535;
+
+// frames are rendered as palette indices: 0 is the gif transparency index,
+// 1..SHADE_LEVELS ramp from black to the model color
+const int SHADE_LEVELS = 255;
+const uint8_t BACKGROUND_SHADE = 1;
\ No newline at end of file
@@ -1,116 +1,828 @@
 #pragma once
 #include <algorithm>
+#include <cstdint>
 #include "util.hpp"
 #include "constants.hpp"
 #include "geometry.hpp"
+#include "clusters.hpp"
+#include "normals.hpp"
+#include "render_spec.hpp"
+#include "stats.hpp"
 #include <cmath>
 #include <string>
 
-float signed_triangle_area(Vec2i a, Vec2i b, Vec2i c)
+// SIMD span kernels, built the same way as gif.h's: GCC and clang on x86 compile the AVX2
+// ones with a target attribute and the KernelLevel picked at startup decides which run.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#include <immintrin.h>
+#define DRAW_SIMD_AVX2
+#define DRAW_SIMD_SSE2
+#define DRAW_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define DRAW_SIMD_AVX2
+#define DRAW_SIMD_SSE2
+#define DRAW_TARGET_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define DRAW_SIMD_SSE2
+#endif
+
+// Screen x and y are 28.4 fixed point: SUBPIXEL_STEPS units per pixel, and pixel (x, y)
+// is sampled at (x * SUBPIXEL_STEPS, y * SUBPIXEL_STEPS). Screen z stays in depth units.
+const int SUBPIXEL_BITS = 4;
+const int SUBPIXEL_STEPS = 1 << SUBPIXEL_BITS;
+
+// MSAA sample positions in fixed point units around a pixel's sample point: the standard
+// 2x and 4x (rotated grid) patterns. A pixel's samples are stored next to each other in the
+// image and depth buffers.
+const int SAMPLE_POSITIONS_1[1][2] = {{0, 0}};
+const int SAMPLE_POSITIONS_2[2][2] = {{4, 4}, {-4, -4}};
+const int SAMPLE_POSITIONS_4[4][2] = {{-2, -6}, {6, -2}, {-6, 2}, {2, 6}};
+
+template <int Samples>
+inline const int (*sample_positions())[2]
+{
+    return Samples == 4 ? SAMPLE_POSITIONS_4 : Samples == 2 ? SAMPLE_POSITIONS_2 : SAMPLE_POSITIONS_1;
+}
+
+// how far samples lie from their pixel's sample point, to widen bounding boxes by
+template <int Samples>
+inline int sample_reach()
 {
-    return .5f * ((b.y - a.y) * (b.x + a.x) + (c.y - b.y) * (c.x + b.x) + (a.y - c.y) * (a.x + c.x));
+    return Samples == 1 ? 0 : 6;
 }
 
-void draw_triangle(Vec3i a, Vec3i b, Vec3i c, Color color, std::vector<uint8_t> &image, std::vector<float> &z_buffer)
+// a projected vertex: fixed point x and y, depth in the units of the depth buffer, and for
+// Gouraud shading its position on the shade ramp, 0..SHADE_LEVELS - 1
+struct ScreenVertex
+{
+    int x;
+    int y;
+    float z;
+    float shade;
+};
+
+// converts a screen coordinate in pixels to fixed point, clamped so edge functions of
+// vertices far outside the frame still fit in 64 bits
+inline int to_fixed(float pixels)
 {
-    // bounding box
-    int minx = std::max(std::min(a.x, std::min(b.x, c.x)), 0);
-    int miny = std::max(std::min(a.y, std::min(b.y, c.y)), 0);
-    int maxx = std::min(std::max(a.x, std::max(b.x, c.x)), WIDTH - 1);
-    int maxy = std::min(std::max(a.y, std::max(b.y, c.y)), HEIGHT - 1);
+    const float limit = 1 << 26;
+    return util::roundftoi(std::max(-limit, std::min(limit, pixels)) * SUBPIXEL_STEPS);
+}
+
+// first and last pixel whose sample lies at or after / at or before a fixed point coordinate
+inline int pixel_ceil(int fixed)
+{
+    return (fixed + SUBPIXEL_STEPS - 1) >> SUBPIXEL_BITS;
+}
+
+inline int pixel_floor(int fixed)
+{
+    return fixed >> SUBPIXEL_BITS;
+}
 
-    float total_area = signed_triangle_area(a.xy(), b.xy(), c.xy());
+// Twice the signed area of (a, b, p): positive when p lies left of a->b. Front facing
+// triangles are counter-clockwise (y up), so their inside is left of all three edges.
+inline int64_t orient2d(const ScreenVertex &a, const ScreenVertex &b, int64_t px, int64_t py)
+{
+    return (int64_t)(b.x - a.x) * (py - a.y) - (int64_t)(b.y - a.y) * (px - a.x);
+}
+
+// Fill rule: a sample exactly on an edge belongs to the triangle only if the edge is a
+// left edge (running down) or a top edge (horizontal, running right to left), so a pixel
+// on an edge shared by two triangles is drawn by exactly one of them. Added to the edge
+// function, it turns coverage into a plain w >= 0 test.
+inline int64_t fill_bias(const ScreenVertex &a, const ScreenVertex &b)
+{
+    int dx = b.x - a.x;
+    int dy = b.y - a.y;
+    return (dy < 0 || (dy == 0 && dx < 0)) ? 0 : -1;
+}
+
+// Depth buffers hold larger values for closer surfaces and are cleared to 0. Depth is
+// reverse-Z: near / distance from the camera, which is 1 at the nearest point of the
+// model's bounding sphere and falls off hyperbolically, so float keeps its precision where
+// the hyperbola flattens. It is affine in screen space, so it interpolates linearly.
+// DEPTH_UNORM16 stores it rescaled to 1..65535 at half the bandwidth of DEPTH_FLOAT32.
+template <class Depth>
+inline Depth depth_value(float z);
+
+template <>
+inline float depth_value<float>(float z)
+{
+    return z;
+}
+
+template <>
+inline uint16_t depth_value<uint16_t>(float z)
+{
+    return (uint16_t)std::min(std::max(z + 0.5f, 0.0f), 65535.0f);
+}
+
+struct DepthBuffer
+{
+    DepthFormat format;
+    std::vector<uint16_t> unorm16;
+    std::vector<float> float32;
 
-    if (total_area <= 0)
+    DepthBuffer(DepthFormat depth_format, size_t size) : format(depth_format)
     {
-        return;
+        if (format == DEPTH_UNORM16)
+        {
+            unorm16.resize(size);
+        }
+        else
+        {
+            float32.resize(size);
+        }
     }
 
-    for (int y = miny; y <= maxy; y++)
+    void clear()
     {
-        for (int x = minx; x <= maxx; x++)
+        std::fill(unorm16.begin(), unorm16.end(), 0);
+        std::fill(float32.begin(), float32.end(), 0.0f);
+    }
+};
+
+// radius of a sphere around the origin containing the model's bounds
+inline float bounding_radius(const Model &model)
+{
+    float x = std::max(std::abs(model.min_x), std::abs(model.max_x));
+    float y = std::max(std::abs(model.min_y), std::abs(model.max_y));
+    float z = std::max(std::abs(model.min_z), std::abs(model.max_z));
+    return std::sqrt(x * x + y * y + z * z);
+}
+
+// camera distance from the model center, as draw_model places it
+inline float camera_position(const Model &model, const RenderSpec &spec)
+{
+    return sqrt(model.max_x * model.max_x + model.max_z * model.max_z) * spec.camera_distance;
+}
+
+// Picks 16 bit depth when one unorm step at the far side of the model is well below the
+// size of its triangles, estimated from the bounds' surface area and the face count, so
+// neighbouring surfaces cannot fight. Close cameras stretch the depth range and need float.
+inline DepthFormat choose_depth_format(Model &model, const RenderSpec &spec)
+{
+    if (spec.depth_format != DEPTH_AUTO)
+    {
+        return spec.depth_format;
+    }
+    float radius = bounding_radius(model);
+    float cam_pos = camera_position(model, spec);
+    if (model.nfaces() == 0 || !(cam_pos > radius))
+    {
+        return DEPTH_FLOAT32;
+    }
+    float ex = model.max_x - model.min_x;
+    float ey = model.max_y - model.min_y;
+    float ez = model.max_z - model.min_z;
+    float area = 2 * (ex * ey + ey * ez + ez * ex);
+    float triangle_size = std::sqrt(2 * area / model.nfaces());
+
+    // d = near / (cam_pos - z) over z in [-radius, radius], 65534 steps from d_min to 1
+    float near = cam_pos - radius;
+    float far = cam_pos + radius;
+    float d_min = near / far;
+    float depth_step = (1 - d_min) / 65534 * far * far / near;
+    return depth_step * 4 < triangle_size ? DEPTH_UNORM16 : DEPTH_FLOAT32;
+}
+
+// maps a position on the shade ramp to its palette index, clamping interpolated positions
+// that land just past either end
+inline uint8_t ramp_index(float ramp)
+{
+    return (uint8_t)(BACKGROUND_SHADE + std::min(std::max(util::roundftoi(ramp), 0), SHADE_LEVELS - 1));
+}
+
+// maps a light value in [0, 1] to an index on the palette ramp
+inline uint8_t shade_index(float light_value)
+{
+    return ramp_index(light_value * (SHADE_LEVELS - 1));
+}
+
+// Narrows [x0, x1] to the pixels of a row where the edge function w + (x - x_base) * dx,
+// with w taken at pixel x_base, is not negative.
+inline void clip_span(int64_t w, int64_t dx, int x_base, int &x0, int &x1)
+{
+    if (dx > 0)
+    {
+        if (w < 0)
+        {
+            x0 = (int)std::max<int64_t>(x0, x_base + (-w + dx - 1) / dx);
+        }
+    }
+    else if (dx < 0)
+    {
+        x1 = w < 0 ? x0 - 1 : (int)std::min<int64_t>(x1, x_base + w / -dx);
+    }
+    else if (w < 0)
+    {
+        x1 = x0 - 1;
+    }
+}
+
+// Depth tests and writes pixels [x0, x1) of a row that the triangle covers. Depth at pixel x
+// is z_base + (x - x_base) * z_dx, evaluated the same way in every kernel so all of them
+// write identical frames. Returns the number of pixels written.
+template <class Depth>
+int draw_span_scalar(uint8_t *image_row, Depth *z_row, int x0, int x1, int x_base, float z_base, float z_dx, uint8_t shade)
+{
+    int written = 0;
+    for (int x = x0; x < x1; x++)
+    {
+        Depth depth = depth_value<Depth>(z_base + (float)(x - x_base) * z_dx);
+        if (depth > z_row[x])
+        {
+            z_row[x] = depth;
+            image_row[x] = shade;
+            written++;
+        }
+    }
+    return written;
+}
+
+#if defined(DRAW_SIMD_SSE2)
+// 4 pixels per iteration; the depth test is vectorized and passing pixels are written from
+// the comparison's bit mask
+inline int draw_span_sse2(uint8_t *image_row, float *z_row, int x0, int x1, int x_base, float z_base, float z_dx, uint8_t shade)
+{
+    const __m128 lanes = _mm_setr_ps(0, 1, 2, 3);
+    int written = 0;
+    int x = x0;
+    for (; x + 4 <= x1; x += 4)
+    {
+        __m128 z = _mm_add_ps(_mm_set1_ps(z_base), _mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)(x - x_base)), lanes), _mm_set1_ps(z_dx)));
+        __m128 old = _mm_loadu_ps(z_row + x);
+        __m128 pass = _mm_cmpgt_ps(z, old);
+        int bits = _mm_movemask_ps(pass);
+        if (bits)
         {
-            Vec2i p = Vec2i(x, y);
-            float alpha = signed_triangle_area(p, b.xy(), c.xy()) / total_area;
-            float beta = signed_triangle_area(p, c.xy(), a.xy()) / total_area;
-            float gamma = signed_triangle_area(p, a.xy(), b.xy()) / total_area;
-            bool inside = alpha >= 0 && alpha <= 1 && beta >= 0 && beta <= 1 && gamma >= 0 && gamma <= 1;
-            if (!inside)
+            _mm_storeu_ps(z_row + x, _mm_or_ps(_mm_and_ps(pass, z), _mm_andnot_ps(pass, old)));
+            for (int i = 0; i < 4; i++)
             {
-                continue;
+                if (bits >> i & 1)
+                {
+                    image_row[x + i] = shade;
+                    written++;
+                }
+            }
+        }
+    }
+    return written + draw_span_scalar(image_row, z_row, x, x1, x_base, z_base, z_dx, shade);
+}
+
+inline int draw_span_sse2(uint8_t *image_row, uint16_t *z_row, int x0, int x1, int x_base, float z_base, float z_dx, uint8_t shade)
+{
+    const __m128 lanes = _mm_setr_ps(0, 1, 2, 3);
+    const __m128 half = _mm_set1_ps(0.5f);
+    const __m128 max_depth = _mm_set1_ps(65535.0f);
+    int written = 0;
+    int x = x0;
+    for (; x + 4 <= x1; x += 4)
+    {
+        __m128 z = _mm_add_ps(_mm_set1_ps(z_base), _mm_mul_ps(_mm_add_ps(_mm_set1_ps((float)(x - x_base)), lanes), _mm_set1_ps(z_dx)));
+        __m128i depth = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_add_ps(z, half), _mm_setzero_ps()), max_depth));
+        __m128i old = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(z_row + x)), _mm_setzero_si128());
+        int bits = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(depth, old)));
+        if (bits)
+        {
+            alignas(16) int32_t depths[4];
+            _mm_store_si128((__m128i *)depths, depth);
+            for (int i = 0; i < 4; i++)
+            {
+                if (bits >> i & 1)
+                {
+                    z_row[x + i] = (uint16_t)depths[i];
+                    image_row[x + i] = shade;
+                    written++;
+                }
             }
+        }
+    }
+    return written + draw_span_scalar(image_row, z_row, x, x1, x_base, z_base, z_dx, shade);
+}
+#endif
 
-            float z_for_pixel = alpha * a.z + beta * b.z + gamma * c.z;
+#if defined(DRAW_SIMD_AVX2)
+// 8 pixels per iteration, otherwise as draw_span_sse2
+DRAW_TARGET_AVX2 inline int draw_span_avx2(uint8_t *image_row, float *z_row, int x0, int x1, int x_base, float z_base, float z_dx, uint8_t shade)
+{
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    int written = 0;
+    int x = x0;
+    for (; x + 8 <= x1; x += 8)
+    {
+        __m256 z = _mm256_add_ps(_mm256_set1_ps(z_base), _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)(x - x_base)), lanes), _mm256_set1_ps(z_dx)));
+        __m256 old = _mm256_loadu_ps(z_row + x);
+        __m256 pass = _mm256_cmp_ps(z, old, _CMP_GT_OQ);
+        int bits = _mm256_movemask_ps(pass);
+        if (bits)
+        {
+            _mm256_storeu_ps(z_row + x, _mm256_blendv_ps(old, z, pass));
+            for (int i = 0; i < 8; i++)
+            {
+                if (bits >> i & 1)
+                {
+                    image_row[x + i] = shade;
+                    written++;
+                }
+            }
+        }
+    }
+    return written + draw_span_scalar(image_row, z_row, x, x1, x_base, z_base, z_dx, shade);
+}
 
-            if (z_for_pixel > z_buffer[y * WIDTH + x])
+DRAW_TARGET_AVX2 inline int draw_span_avx2(uint8_t *image_row, uint16_t *z_row, int x0, int x1, int x_base, float z_base, float z_dx, uint8_t shade)
+{
+    const __m256 lanes = _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7);
+    const __m256 half = _mm256_set1_ps(0.5f);
+    const __m256 max_depth = _mm256_set1_ps(65535.0f);
+    int written = 0;
+    int x = x0;
+    for (; x + 8 <= x1; x += 8)
+    {
+        __m256 z = _mm256_add_ps(_mm256_set1_ps(z_base), _mm256_mul_ps(_mm256_add_ps(_mm256_set1_ps((float)(x - x_base)), lanes), _mm256_set1_ps(z_dx)));
+        __m256i depth = _mm256_cvttps_epi32(_mm256_min_ps(_mm256_max_ps(_mm256_add_ps(z, half), _mm256_setzero_ps()), max_depth));
+        __m256i old = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(z_row + x)));
+        int bits = _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(depth, old)));
+        if (bits)
+        {
+            alignas(32) int32_t depths[8];
+            _mm256_store_si256((__m256i *)depths, depth);
+            for (int i = 0; i < 8; i++)
             {
-                z_buffer[y * WIDTH + x] = z_for_pixel;
-                image[(y * WIDTH + x) * 4] = color.r;
-                image[(y * WIDTH + x) * 4 + 1] = color.g;
-                image[(y * WIDTH + x) * 4 + 2] = color.b;
-                image[(y * WIDTH + x) * 4 + 3] = color.a;
+                if (bits >> i & 1)
+                {
+                    z_row[x + i] = (uint16_t)depths[i];
+                    image_row[x + i] = shade;
+                    written++;
+                }
             }
         }
     }
+    return written + draw_span_scalar(image_row, z_row, x, x1, x_base, z_base, z_dx, shade);
+}
+#endif
+
+// Gouraud variant of draw_span_scalar: the shade ramp position is a second plane stepped like
+// depth, and every written pixel gets its own palette index. Used at every kernel level.
+template <class Depth>
+int draw_span_smooth(uint8_t *image_row, Depth *z_row, int x0, int x1, int x_base, float z_base, float z_dx, float s_base, float s_dx)
+{
+    int written = 0;
+    for (int x = x0; x < x1; x++)
+    {
+        Depth depth = depth_value<Depth>(z_base + (float)(x - x_base) * z_dx);
+        if (depth > z_row[x])
+        {
+            z_row[x] = depth;
+            image_row[x] = ramp_index(s_base + (float)(x - x_base) * s_dx);
+            written++;
+        }
+    }
+    return written;
+}
+
+// runs the span kernel of the given level, or the best one compiled in below it
+template <class Depth>
+inline int draw_span(KernelLevel kernel, uint8_t *image_row, Depth *z_row, int x0, int x1, int x_base, float z_base, float z_dx, uint8_t shade)
+{
+#if defined(DRAW_SIMD_AVX2)
+    if (kernel >= KERNEL_AVX2)
+    {
+        return draw_span_avx2(image_row, z_row, x0, x1, x_base, z_base, z_dx, shade);
+    }
+#endif
+#if defined(DRAW_SIMD_SSE2)
+    if (kernel >= KERNEL_SSE)
+    {
+        return draw_span_sse2(image_row, z_row, x0, x1, x_base, z_base, z_dx, shade);
+    }
+#endif
+    (void)kernel;
+    return draw_span_scalar(image_row, z_row, x0, x1, x_base, z_base, z_dx, shade);
 }
 
-void draw_model(Model model, float angle, Color color, std::vector<uint8_t> &image, std::vector<float> &z_buffer)
+// Rasterizes a front facing triangle with fixed point screen coordinates. Edge functions and
+// depth are stepped incrementally across the bounding box, per pixel, and offset from there
+// to each of the pixel's Samples coverage samples. Without MSAA each row is first clipped to
+// the exact span the edge functions cover, which the kernel's span loop then depth tests.
+// With smooth set, the vertices' shade ramp positions are interpolated across the triangle,
+// evaluated once per pixel, and shade is ignored.
+// image holds Samples palette indices per pixel, width * height * Samples.
+// Returns the number of samples written.
+template <class Depth, int Samples>
+int draw_triangle(ScreenVertex a, ScreenVertex b, ScreenVertex c, uint8_t shade, bool smooth, int width, int height, std::vector<uint8_t> &image, std::vector<Depth> &z_buffer, KernelLevel kernel)
 {
-    for (int i = 0; i < model.nfaces(); i++)
+    int64_t area = orient2d(a, b, c.x, c.y);
+    if (area <= 0)
+    {
+        return 0;
+    }
+
+    // bounding box of the pixels with a sample that may be covered
+    const int reach = sample_reach<Samples>();
+    int minx = std::max(pixel_ceil(std::min(a.x, std::min(b.x, c.x)) - reach), 0);
+    int miny = std::max(pixel_ceil(std::min(a.y, std::min(b.y, c.y)) - reach), 0);
+    int maxx = std::min(pixel_floor(std::max(a.x, std::max(b.x, c.x)) + reach), width - 1);
+    int maxy = std::min(pixel_floor(std::max(a.y, std::max(b.y, c.y)) + reach), height - 1);
+    if (minx > maxx || miny > maxy)
     {
-        std::vector<int> face = model.face(i);
-        if (face.size() != 3)
+        return 0;
+    }
+
+    // edge functions at the first sample; w0 weights a, w1 weights b and w2 weights c
+    const int64_t px = (int64_t)minx * SUBPIXEL_STEPS;
+    const int64_t py = (int64_t)miny * SUBPIXEL_STEPS;
+    const int64_t bias0 = fill_bias(b, c);
+    const int64_t bias1 = fill_bias(c, a);
+    const int64_t bias2 = fill_bias(a, b);
+    int64_t w0_row = orient2d(b, c, px, py) + bias0;
+    int64_t w1_row = orient2d(c, a, px, py) + bias1;
+    int64_t w2_row = orient2d(a, b, px, py) + bias2;
+    const int64_t w0_dx = (int64_t)(b.y - c.y) * SUBPIXEL_STEPS;
+    const int64_t w1_dx = (int64_t)(c.y - a.y) * SUBPIXEL_STEPS;
+    const int64_t w2_dx = (int64_t)(a.y - b.y) * SUBPIXEL_STEPS;
+    const int64_t w0_dy = (int64_t)(c.x - b.x) * SUBPIXEL_STEPS;
+    const int64_t w1_dy = (int64_t)(a.x - c.x) * SUBPIXEL_STEPS;
+    const int64_t w2_dy = (int64_t)(b.x - a.x) * SUBPIXEL_STEPS;
+
+    // depth is a plane over the triangle: start each row exactly, step it along the row
+    const double inv_area = 1.0 / (double)area;
+    const float z_dx = (float)(((double)w0_dx * a.z + (double)w1_dx * b.z + (double)w2_dx * c.z) * inv_area);
+    const float z_dy = (float)(((double)w0_dy * a.z + (double)w1_dy * b.z + (double)w2_dy * c.z) * inv_area);
+    const float s_dx = smooth ? (float)(((double)w0_dx * a.shade + (double)w1_dx * b.shade + (double)w2_dx * c.shade) * inv_area) : 0;
+
+    // edge function and depth offsets of each sample from the pixel's sample point
+    const int (*positions)[2] = sample_positions<Samples>();
+    int64_t w0_offset[Samples], w1_offset[Samples], w2_offset[Samples];
+    float z_offset[Samples];
+    for (int s = 0; s < Samples; s++)
+    {
+        const int sx = positions[s][0];
+        const int sy = positions[s][1];
+        w0_offset[s] = (w0_dx * sx + w0_dy * sy) / SUBPIXEL_STEPS;
+        w1_offset[s] = (w1_dx * sx + w1_dy * sy) / SUBPIXEL_STEPS;
+        w2_offset[s] = (w2_dx * sx + w2_dy * sy) / SUBPIXEL_STEPS;
+        z_offset[s] = (z_dx * sx + z_dy * sy) / SUBPIXEL_STEPS;
+    }
+
+    int written = 0;
+    for (int y = miny; y <= maxy; y++)
+    {
+        int64_t w0 = w0_row;
+        int64_t w1 = w1_row;
+        int64_t w2 = w2_row;
+        float z_for_pixel = (float)(((double)(w0 - bias0) * a.z + (double)(w1 - bias1) * b.z + (double)(w2 - bias2) * c.z) * inv_area);
+        float s_for_pixel = smooth ? (float)(((double)(w0 - bias0) * a.shade + (double)(w1 - bias1) * b.shade + (double)(w2 - bias2) * c.shade) * inv_area) : 0;
+        uint8_t *image_row = &image[(size_t)y * width * Samples];
+        Depth *z_row = &z_buffer[(size_t)y * width * Samples];
+
+        if (Samples == 1)
         {
+            int x0 = minx;
+            int x1 = maxx;
+            clip_span(w0, w0_dx, minx, x0, x1);
+            clip_span(w1, w1_dx, minx, x0, x1);
+            clip_span(w2, w2_dx, minx, x0, x1);
+            if (x0 <= x1 && smooth)
+            {
+                written += draw_span_smooth(image_row, z_row, x0, x1 + 1, minx, z_for_pixel, z_dx, s_for_pixel, s_dx);
+            }
+            else if (x0 <= x1)
+            {
+                written += draw_span(kernel, image_row, z_row, x0, x1 + 1, minx, z_for_pixel, z_dx, shade);
+            }
+            w0_row += w0_dy;
+            w1_row += w1_dy;
+            w2_row += w2_dy;
             continue;
         }
-        Vec3f v0_world = model.vert(face[0]);
-        Vec3f v1_world = model.vert(face[1]);
-        Vec3f v2_world = model.vert(face[2]);
-        Mat3<float> rot_y_mat = Mat3<float>(
-            cos(angle), 0, sin(angle),
-            0, 1, 0,
-            -sin(angle), 0, cos(angle));
-        v0_world = rot_y_mat * v0_world;
-        v1_world = rot_y_mat * v1_world;
-        v2_world = rot_y_mat * v2_world;
 
+        for (int x = minx; x <= maxx; x++)
+        {
+            for (int s = 0; s < Samples; s++)
+            {
+                Depth depth = depth_value<Depth>(z_for_pixel + z_offset[s]);
+                if (((w0 + w0_offset[s]) | (w1 + w1_offset[s]) | (w2 + w2_offset[s])) >= 0 && depth > z_row[x * Samples + s])
+                {
+                    z_row[x * Samples + s] = depth;
+                    image_row[x * Samples + s] = smooth ? ramp_index(s_for_pixel) : shade;
+                    written++;
+                }
+            }
+            w0 += w0_dx;
+            w1 += w1_dx;
+            w2 += w2_dx;
+            z_for_pixel += z_dx;
+            s_for_pixel += s_dx;
+        }
+
+        w0_row += w0_dy;
+        w1_row += w1_dy;
+        w2_row += w2_dy;
+    }
+    return written;
+}
+
+// rotation by angle (radians) around a unit axis
+inline Mat3f axis_rotation(Vec3f axis, float angle)
+{
+    float c = cos(angle);
+    float s = sin(angle);
+    float t = 1 - c;
+    return Mat3f(
+        t * axis.x * axis.x + c, t * axis.x * axis.y - s * axis.z, t * axis.x * axis.z + s * axis.y,
+        t * axis.x * axis.y + s * axis.z, t * axis.y * axis.y + c, t * axis.y * axis.z - s * axis.x,
+        t * axis.x * axis.z - s * axis.y, t * axis.y * axis.z + s * axis.x, t * axis.z * axis.z + c);
+}
+
+// Projected, shaded triangles waiting to be rasterized, as a structure of arrays. Triangles
+// whose bounding box spans at most 2x2 pixels get a batch of their own, so dense meshes are
+// rasterized in one tight pass instead of paying full setup per triangle. Smooth batches
+// also keep the corners' shade ramp positions.
+struct TriangleBatch
+{
+    bool smooth = false;
+    std::vector<int> ax, ay, bx, by, cx, cy;
+    std::vector<float> az, bz, cz;
+    std::vector<float> as, bs, cs;
+    std::vector<uint8_t> shade;
+
+    void push(ScreenVertex a, ScreenVertex b, ScreenVertex c, uint8_t s)
+    {
+        if (smooth)
+        {
+            as.push_back(a.shade);
+            bs.push_back(b.shade);
+            cs.push_back(c.shade);
+        }
+        ax.push_back(a.x);
+        ay.push_back(a.y);
+        az.push_back(a.z);
+        bx.push_back(b.x);
+        by.push_back(b.y);
+        bz.push_back(b.z);
+        cx.push_back(c.x);
+        cy.push_back(c.y);
+        cz.push_back(c.z);
+        shade.push_back(s);
+    }
+
+    size_t size() const
+    {
+        return shade.size();
+    }
+
+    void get(size_t i, ScreenVertex &a, ScreenVertex &b, ScreenVertex &c) const
+    {
+        a = ScreenVertex{ax[i], ay[i], az[i], smooth ? as[i] : 0};
+        b = ScreenVertex{bx[i], by[i], bz[i], smooth ? bs[i] : 0};
+        c = ScreenVertex{cx[i], cy[i], cz[i], smooth ? cs[i] : 0};
+    }
+};
+
+// Rasterizes small triangles by evaluating the edge functions directly at each sample of
+// their (at most four) pixels, with the same fill rule as draw_triangle. The triangles are
+// already known to be front facing and on screen. Returns the number of samples written.
+template <class Depth, int Samples>
+int draw_small_triangles(const TriangleBatch &tris, int width, int height, std::vector<uint8_t> &image, std::vector<Depth> &z_buffer)
+{
+    int written = 0;
+    for (size_t i = 0; i < tris.size(); i++)
+    {
+        ScreenVertex a, b, c;
+        tris.get(i, a, b, c);
+        const double inv_area = 1.0 / (double)orient2d(a, b, c.x, c.y);
+        const int64_t bias0 = fill_bias(b, c);
+        const int64_t bias1 = fill_bias(c, a);
+        const int64_t bias2 = fill_bias(a, b);
+        const int reach = sample_reach<Samples>();
+        int minx = std::max(pixel_ceil(std::min(a.x, std::min(b.x, c.x)) - reach), 0);
+        int miny = std::max(pixel_ceil(std::min(a.y, std::min(b.y, c.y)) - reach), 0);
+        int maxx = std::min(pixel_floor(std::max(a.x, std::max(b.x, c.x)) + reach), width - 1);
+        int maxy = std::min(pixel_floor(std::max(a.y, std::max(b.y, c.y)) + reach), height - 1);
+        const int (*positions)[2] = sample_positions<Samples>();
+
+        for (int y = miny; y <= maxy; y++)
+        {
+            for (int x = minx; x <= maxx; x++)
+            {
+                for (int s = 0; s < Samples; s++)
+                {
+                    int64_t px = (int64_t)x * SUBPIXEL_STEPS + positions[s][0];
+                    int64_t py = (int64_t)y * SUBPIXEL_STEPS + positions[s][1];
+                    int64_t w0 = orient2d(b, c, px, py);
+                    int64_t w1 = orient2d(c, a, px, py);
+                    int64_t w2 = orient2d(a, b, px, py);
+                    if (((w0 + bias0) | (w1 + bias1) | (w2 + bias2)) < 0)
+                    {
+                        continue;
+                    }
+                    Depth depth = depth_value<Depth>((float)(((double)w0 * a.z + (double)w1 * b.z + (double)w2 * c.z) * inv_area));
+                    size_t sample = ((size_t)y * width + x) * Samples + s;
+                    if (depth > z_buffer[sample])
+                    {
+                        z_buffer[sample] = depth;
+                        image[sample] = tris.smooth ? ramp_index((float)(((double)w0 * a.shade + (double)w1 * b.shade + (double)w2 * c.shade) * inv_area)) : tris.shade[i];
+                        written++;
+                    }
+                }
+            }
+        }
+    }
+    return written;
+}
+
+// maps a perspective corrected model x or y coordinate to its pixel column or row
+inline float screen_x(const Model &model, int width, float x)
+{
+    return util::remap(x, model.min_x, model.max_x, width / 4, width - width / 4);
+}
+
+inline float screen_y(const Model &model, int height, float y)
+{
+    return util::remap(y, model.min_y, model.max_y, height / 4, height - height / 4);
+}
+
+// True if the rotated bounding sphere (center, radius) projects entirely outside the frame.
+// The perspective scale c / (c - z) is bounded over the sphere's depth range, with a pixel
+// of margin for rounding.
+inline bool sphere_offscreen(const Model &model, int width, int height, Vec3f center, float radius, float cam_pos)
+{
+    if (center.z + radius >= cam_pos)
+    {
+        return false;
+    }
+    float near_scale = cam_pos / (cam_pos - (center.z + radius));
+    float far_scale = cam_pos / (cam_pos - (center.z - radius));
+    float lo_x = std::min((center.x - radius) * near_scale, (center.x - radius) * far_scale);
+    float hi_x = std::max((center.x + radius) * near_scale, (center.x + radius) * far_scale);
+    float lo_y = std::min((center.y - radius) * near_scale, (center.y - radius) * far_scale);
+    float hi_y = std::max((center.y + radius) * near_scale, (center.y + radius) * far_scale);
+    return screen_x(model, width, hi_x) < -1 || screen_x(model, width, lo_x) > width ||
+           screen_y(model, height, hi_y) < -1 || screen_y(model, height, lo_y) > height;
+}
+
+template <class Depth, int Samples>
+void draw_model_samples(Model &model, const MeshClusters &clusters, const TurntableLighting &lighting, const RenderSpec &spec, float angle, std::vector<uint8_t> &image, std::vector<Depth> &z_buffer)
+{
+    const int width = spec.width;
+    const int height = spec.height;
+    Vec3f axis = spec.axis;
+    const Mat3f rotation = axis_rotation(axis.normalize(), angle);
+    // the lighting table gives each face's and vertex's light from the angle alone
+    const float cos_angle = cos(angle);
+    const float sin_angle = sin(angle);
+    const bool smooth = spec.shading == SHADING_GOURAUD;
+    float cam_pos = camera_position(model, spec);
+
+    // reverse-Z depth near / (cam_pos - z), rescaled to 1..65535 for 16 bit buffers
+    float radius = bounding_radius(model);
+    float near = cam_pos > radius ? cam_pos - radius : cam_pos * 0.01f;
+    float depth_scale = 1;
+    float depth_offset = 0;
+    if (sizeof(Depth) == sizeof(uint16_t))
+    {
+        float d_min = near / (cam_pos + radius);
+        depth_scale = 65534 / (1 - d_min);
+        depth_offset = 1 - d_min * depth_scale;
+    }
+    // the camera sits at (0, 0, cam_pos) after rotation; clusters are tested in model space
+    const Vec3f eye = rotation.transpose() * Vec3f(0, 0, cam_pos);
+
+    // vertices are transformed once, the first time a visible cluster uses them
+    std::vector<ScreenVertex> screen(model.nverts());
+    std::vector<uint8_t> transformed(model.nverts(), 0);
+    auto transform = [&](int i)
+    {
+        if (transformed[i])
+        {
+            return;
+        }
+        transformed[i] = 1;
+        Vec3f v = rotation * model.vert(i);
+        float depth = near / (cam_pos - v.z) * depth_scale + depth_offset;
+        if (sizeof(Depth) == sizeof(uint16_t))
+        {
+            depth = std::max(1.0f, std::min(65535.0f, depth));
+        }
         // perspective
-        float model_max_radius = sqrt(model.max_x * model.max_x + model.max_z * model.max_z);
-        float cam_pos = model_max_radius * 3;
-        v0_world = v0_world * (1 / (1 - v0_world.z / cam_pos));
-        v1_world = v1_world * (1 / (1 - v1_world.z / cam_pos));
-        v2_world = v2_world * (1 / (1 - v2_world.z / cam_pos));
-
-        Vec3f light_dir = Vec3f(0.5f, 0.5f, 1).normalize();
-        Vec3f face_v_a = v1_world - v0_world;
-        Vec3f face_v_b = v2_world - v0_world;
-        Vec3f face_normal = face_v_a.cross(face_v_b).normalize();
-        float light_value = light_dir.dot(face_normal);
-        light_value = light_value < 0 ? 0 : light_value > 1 ? 1
-                                                            : light_value;
-
-        float z_scale = 1000;
-        Vec3f v0_screen = Vec3f(
-            util::remap(v0_world.x, model.min_x, model.max_x, WIDTH / 4, WIDTH - WIDTH / 4),
-            util::remap(v0_world.y, model.min_y, model.max_y, HEIGHT / 4, HEIGHT - HEIGHT / 4),
-            (v0_world.z + model_max_radius) * z_scale);
-        Vec3f v1_screen = Vec3f(
-            util::remap(v1_world.x, model.min_x, model.max_x, WIDTH / 4, WIDTH - WIDTH / 4),
-            util::remap(v1_world.y, model.min_y, model.max_y, HEIGHT / 4, HEIGHT - HEIGHT / 4),
-            (v1_world.z + model_max_radius) * z_scale);
-        Vec3f v2_screen = Vec3f(
-            util::remap(v2_world.x, model.min_x, model.max_x, WIDTH / 4, WIDTH - WIDTH / 4),
-            util::remap(v2_world.y, model.min_y, model.max_y, HEIGHT / 4, HEIGHT - HEIGHT / 4),
-            (v2_world.z + model_max_radius) * z_scale);
-
-        float r = (float)color.r * light_value;
-        float g = (float)color.g * light_value;
-        float b = (float)color.b * light_value;
-        Color color_result = Color{(uint8_t)util::roundftoi(r), (uint8_t)util::roundftoi(g), (uint8_t)util::roundftoi(b), color.a};
-        draw_triangle(
-            Vec3i(util::roundftoi(v0_screen.x), util::roundftoi(v0_screen.y), util::roundftoi(v0_screen.z)),
-            Vec3i(util::roundftoi(v1_screen.x), util::roundftoi(v1_screen.y), util::roundftoi(v1_screen.z)),
-            Vec3i(util::roundftoi(v2_screen.x), util::roundftoi(v2_screen.y), util::roundftoi(v2_screen.z)),
-            color_result, image, z_buffer);
-    }
-}
\ No newline at end of file
+        v = v * (1 / (1 - v.z / cam_pos));
+        float shade = smooth ? std::min(std::max(lighting.vertex_light(i, cos_angle, sin_angle), 0.0f), 1.0f) * (SHADE_LEVELS - 1) : 0;
+        screen[i] = ScreenVertex{
+            to_fixed(screen_x(model, width, v.x)),
+            to_fixed(screen_y(model, height, v.y)),
+            depth,
+            shade};
+    };
+
+    // first pass: transform, cull and shade; second pass: rasterize in the same order
+    TriangleBatch large;
+    TriangleBatch small;
+    large.smooth = smooth;
+    small.smooth = smooth;
+    uint64_t culled = 0;
+    {
+        ScopedTimer timer(TIMER_TRANSFORM);
+        for (const MeshCluster &cluster : clusters.clusters)
+        {
+            if (cluster_backfacing(cluster, eye) ||
+                sphere_offscreen(model, width, height, rotation * cluster.center, cluster.radius, cam_pos))
+            {
+                culled += cluster.count;
+                continue;
+            }
+
+            // light the whole cluster in one pass the compiler can vectorize
+            float light_values[CLUSTER_TRIANGLES];
+            for (int t = 0; t < cluster.count; t++)
+            {
+                light_values[t] = lighting.face_light(cluster.first + t, cos_angle, sin_angle);
+            }
+
+            for (int t = cluster.first; t < cluster.first + cluster.count; t++)
+            {
+                Triangle face = model.face(clusters.triangles[t]);
+                transform(face[0]);
+                transform(face[1]);
+                transform(face[2]);
+                ScreenVertex a = screen[face[0]];
+                ScreenVertex b = screen[face[1]];
+                ScreenVertex c = screen[face[2]];
+
+                // cull back facing, degenerate and off screen triangles before any shading work,
+                // as well as triangles whose bounding box holds no sample
+                if (orient2d(a, b, c.x, c.y) <= 0)
+                {
+                    culled++;
+                    continue;
+                }
+                const int reach = sample_reach<Samples>();
+                int minx = std::max(pixel_ceil(std::min(a.x, std::min(b.x, c.x)) - reach), 0);
+                int miny = std::max(pixel_ceil(std::min(a.y, std::min(b.y, c.y)) - reach), 0);
+                int maxx = std::min(pixel_floor(std::max(a.x, std::max(b.x, c.x)) + reach), width - 1);
+                int maxy = std::min(pixel_floor(std::max(a.y, std::max(b.y, c.y)) + reach), height - 1);
+                if (minx > maxx || miny > maxy)
+                {
+                    culled++;
+                    continue;
+                }
+
+                float light_value = light_values[t - cluster.first];
+                light_value = light_value < 0 ? 0 : light_value > 1 ? 1
+                                                                    : light_value;
+
+                TriangleBatch &batch = maxx - minx <= 1 && maxy - miny <= 1 ? small : large;
+                batch.push(a, b, c, shade_index(light_value));
+            }
+        }
+    }
+
+    ScopedTimer timer(TIMER_RASTER);
+    uint64_t written = 0;
+    for (size_t i = 0; i < large.size(); i++)
+    {
+        ScreenVertex a, b, c;
+        large.get(i, a, b, c);
+        written += draw_triangle<Depth, Samples>(a, b, c, large.shade[i], smooth, width, height, image, z_buffer, spec.kernel);
+    }
+    written += draw_small_triangles<Depth, Samples>(small, width, height, image, z_buffer);
+
+    count_stat(COUNTER_TRIANGLES_CULLED, culled);
+    count_stat(COUNTER_TRIANGLES_DRAWN, large.size() + small.size());
+    count_stat(COUNTER_PIXELS_SHADED, written);
+}
+
+template <class Depth>
+void draw_model_depth(Model &model, const MeshClusters &clusters, const TurntableLighting &lighting, const RenderSpec &spec, float angle, std::vector<uint8_t> &image, std::vector<Depth> &z_buffer)
+{
+    if (spec.msaa == 4)
+    {
+        draw_model_samples<Depth, 4>(model, clusters, lighting, spec, angle, image, z_buffer);
+    }
+    else if (spec.msaa == 2)
+    {
+        draw_model_samples<Depth, 2>(model, clusters, lighting, spec, angle, image, z_buffer);
+    }
+    else
+    {
+        draw_model_samples<Depth, 1>(model, clusters, lighting, spec, angle, image, z_buffer);
+    }
+}
+
+// Renders the model turned by angle (radians) around spec.axis. image and depth hold
+// spec.msaa samples per pixel.
+void draw_model(Model &model, const MeshClusters &clusters, const TurntableLighting &lighting, const RenderSpec &spec, float angle, std::vector<uint8_t> &image, DepthBuffer &depth)
+{
+    if (depth.format == DEPTH_UNORM16)
+    {
+        draw_model_depth(model, clusters, lighting, spec, angle, image, depth.unorm16);
+    }
+    else
+    {
+        draw_model_depth(model, clusters, lighting, spec, angle, image, depth.float32);
+    }
+}
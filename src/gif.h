@@ -14,7 +14,8 @@
 // So resulting files are often quite large. The hope is that it will be handy nonetheless
 // as a quick and easily-integrated way for programs to spit out animations.
 //
-// Only RGBA8 is currently supported as an input format. (The alpha is ignored.)
+// Input is either RGBA8 (the alpha is ignored) or, through GifWriteFrameIndexed(), one byte
+// per pixel of indices into a caller-supplied palette such as the one from GifMakeRampPalette().
 //
 // If capturing a buffer with a bottom-left origin (such as OpenGL), define GIF_FLIP_VERT
 // to automatically flip the buffer data when writing the image (the buffer itself is
@@ -22,6 +23,7 @@
 //
 // USAGE:
 // Create a GifWriter struct. Pass it to GifBegin() to initialize and write the header.
+// (Or GifBeginFd(), GifBeginMemory() or GifBeginSink() to stream the gif somewhere other than a file.)
 // Pass subsequent frames to GifWriteFrame().
 // Finally, call GifEnd() to close the file handle and free memory.
 //
@@ -30,15 +32,63 @@
 #define gif_h
 
 #include <stdio.h>   // for FILE*
+#include <errno.h>   // for EINTR
+#ifdef _WIN32
+#include <io.h>      // for _write
+#else
+#include <unistd.h>  // for write
+#endif
 #include <string.h>  // for memcpy and bzero
 #include <stdint.h>  // for integer typedefs
+#include <stddef.h>  // for ptrdiff_t
+
+#ifndef GIF_NO_THREADS
+#include <thread>    // palette subtrees are built in parallel; define GIF_NO_THREADS to disable
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <algorithm>
+#endif
 #include <stdbool.h> // for bool macros
+#include "hash.hpp"   // content_hash recognizes repeated frames, and checksums golden and cached renders
+
+// SIMD versions of the per-pixel kernels (change detection, delta, MSAA resolve and
+// thresholding) are compiled in when the compiler can target them. GCC and clang on x86
+// always build the AVX2 versions, through a target attribute, so one binary uses AVX2 where
+// the CPU has it and SSE2 elsewhere. The level is detected at startup; GifSetKernel() can
+// force a lower one, down to the scalar reference code, for testing and benchmarking.
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__)))
+#include <immintrin.h>
+#define GIF_SIMD_AVX2
+#define GIF_SIMD_SSE2
+#define GIF_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#define GIF_SIMD_AVX2
+#define GIF_SIMD_SSE2
+#define GIF_TARGET_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define GIF_SIMD_SSE2
+#endif
 
 // Define these macros to hook into a custom memory allocator.
 // TEMP_MALLOC and TEMP_FREE will only be called in stack fashion - frees in the reverse order of mallocs
 // and any temp memory allocated by a function will be freed before it exits.
-// MALLOC and FREE are used only by GifBegin and GifEnd respectively (to allocate a buffer the size of the image, which
-// is used to find changed pixels for delta-encoding.)
+// MALLOC and FREE are used for the writer's persistent buffers (a buffer the size of the image, which
+// is used to find changed pixels for delta-encoding, and the color histogram used to build palettes.)
+// They are freed by GifEnd.
+
+// Define these macros to instrument the encoder. GIF_SCOPE_TIMER(stage) times the rest of
+// the enclosing scope as one of the stages PALETTE, THRESHOLD, DELTA, LZW and IO;
+// GIF_COUNT(counter, n) adds n to the counter BYTES_WRITTEN.
+#ifndef GIF_SCOPE_TIMER
+#define GIF_SCOPE_TIMER(stage)
+#endif
+
+#ifndef GIF_COUNT
+#define GIF_COUNT(counter, n)
+#endif
 
 #ifndef GIF_TEMP_MALLOC
 #include <stdlib.h>
@@ -60,6 +110,12 @@
 #define GIF_FREE free
 #endif
 
+// Used only to grow GifMemoryBuffer sinks
+#ifndef GIF_REALLOC
+#include <stdlib.h>
+#define GIF_REALLOC realloc
+#endif
+
 const int kGifTransIndex = 0;
 
 typedef struct
@@ -82,6 +138,325 @@ int GifIMax(int l, int r) { return l>r?l:r; }
 int GifIMin(int l, int r) { return l<r?l:r; }
 int GifIAbs(int i) { return i<0?-i:i; }
 
+typedef enum
+{
+    GifKernelScalar,
+    GifKernelSSE2,
+    GifKernelAVX2
+} GifKernel;
+
+// best kernel level supported by both this build and the CPU
+GifKernel GifDetectKernel()
+{
+#if defined(GIF_SIMD_AVX2) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) return GifKernelAVX2;
+#elif defined(GIF_SIMD_AVX2)
+    return GifKernelAVX2;
+#endif
+#if defined(GIF_SIMD_SSE2)
+    return GifKernelSSE2;
+#else
+    return GifKernelScalar;
+#endif
+}
+
+GifKernel gGifKernel = GifDetectKernel();
+
+// Selects the kernels used from now on, at most the detected level. Returns the level in use.
+GifKernel GifSetKernel( GifKernel kernel )
+{
+    GifKernel best = GifDetectKernel();
+    gGifKernel = kernel < best? kernel : best;
+    return gGifKernel;
+}
+
+int GifPopCount(uint32_t v)
+{
+    v = v - ((v >> 1) & 0x55555555u);
+    v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+    return (int)((((v + (v >> 4)) & 0x0f0f0f0fu) * 0x01010101u) >> 24);
+}
+
+#if defined(GIF_SIMD_AVX2)
+// AVX2 part of GifComputeChangeMask: handles whole blocks of 32 pixels and returns the
+// index of the first pixel left over
+GIF_TARGET_AVX2 int GifComputeChangeMaskAVX2( const uint8_t* lastFrame, const uint8_t* frame, int numPixels, uint8_t* changeMask, int* numChanged )
+{
+    int ii = 0;
+    // 32 pixels per iteration: compare bytes, fold each pixel's RGB into one 32-bit lane,
+    // then pack the lanes down to one byte per pixel
+    const __m256i alpha32 = _mm256_set1_epi32((int)0xff000000);
+    const __m256i allSet32 = _mm256_set1_epi32(-1);
+    const __m256i ones32 = _mm256_set1_epi8(1);
+    const __m256i lanes32 = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    for(; ii+32<=numPixels; ii+=32)
+    {
+        __m256i same[4];
+        for(int kk=0; kk<4; ++kk)
+        {
+            __m256i a = _mm256_loadu_si256((const __m256i*)(lastFrame + (ii+kk*8)*4));
+            __m256i b = _mm256_loadu_si256((const __m256i*)(frame + (ii+kk*8)*4));
+            __m256i eq = _mm256_or_si256(_mm256_cmpeq_epi8(a, b), alpha32);
+            same[kk] = _mm256_cmpeq_epi32(eq, allSet32);
+        }
+        __m256i packed = _mm256_packs_epi16(_mm256_packs_epi32(same[0], same[1]), _mm256_packs_epi32(same[2], same[3]));
+        packed = _mm256_permutevar8x32_epi32(packed, lanes32);
+        _mm256_storeu_si256((__m256i*)(changeMask + ii), _mm256_andnot_si256(packed, ones32));
+        *numChanged += 32 - GifPopCount((uint32_t)_mm256_movemask_epi8(packed));
+    }
+    return ii;
+}
+#endif
+
+// Compares the RGB of two RGBA images and writes 1 into changeMask for every pixel that
+// differs, 0 otherwise. Returns the number of changed pixels.
+// The mask is computed once per frame and shared by palette building, thresholding
+// and the dirty rectangle.
+int GifComputeChangeMask( const uint8_t* lastFrame, const uint8_t* frame, int numPixels, uint8_t* changeMask )
+{
+    GIF_SCOPE_TIMER(DELTA);
+    int numChanged = 0;
+    int ii = 0;
+
+#if defined(GIF_SIMD_AVX2)
+    if(gGifKernel >= GifKernelAVX2)
+        ii = GifComputeChangeMaskAVX2(lastFrame, frame, numPixels, changeMask, &numChanged);
+#endif
+#if defined(GIF_SIMD_SSE2)
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    const __m128i allSet = _mm_set1_epi32(-1);
+    const __m128i ones = _mm_set1_epi8(1);
+    for(; gGifKernel >= GifKernelSSE2 && ii+16<=numPixels; ii+=16)
+    {
+        __m128i same[4];
+        for(int kk=0; kk<4; ++kk)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i*)(lastFrame + (ii+kk*4)*4));
+            __m128i b = _mm_loadu_si128((const __m128i*)(frame + (ii+kk*4)*4));
+            __m128i eq = _mm_or_si128(_mm_cmpeq_epi8(a, b), alpha);
+            same[kk] = _mm_cmpeq_epi32(eq, allSet);
+        }
+        __m128i packed = _mm_packs_epi16(_mm_packs_epi32(same[0], same[1]), _mm_packs_epi32(same[2], same[3]));
+        _mm_storeu_si128((__m128i*)(changeMask + ii), _mm_andnot_si128(packed, ones));
+        numChanged += 16 - GifPopCount((uint32_t)_mm_movemask_epi8(packed));
+    }
+#endif
+
+    for(; ii<numPixels; ++ii)
+    {
+        const uint8_t* a = lastFrame + ii*4;
+        const uint8_t* b = frame + ii*4;
+        uint8_t changed = (a[0] != b[0] || a[1] != b[1] || a[2] != b[2])? 1 : 0;
+        changeMask[ii] = changed;
+        numChanged += changed;
+    }
+
+    return numChanged;
+}
+
+#if defined(GIF_SIMD_AVX2)
+// AVX2 part of GifDeltaIndices, see GifComputeChangeMaskAVX2
+GIF_TARGET_AVX2 int GifDeltaIndicesAVX2( const uint8_t* lastIndices, const uint8_t* indices, uint8_t* outIndices, int numPixels, int* numChanged )
+{
+    int ii = 0;
+    for(; ii+32<=numPixels; ii+=32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i*)(lastIndices + ii));
+        __m256i b = _mm256_loadu_si256((const __m256i*)(indices + ii));
+        __m256i same = _mm256_cmpeq_epi8(a, b);
+        _mm256_storeu_si256((__m256i*)(outIndices + ii), _mm256_andnot_si256(same, b));
+        *numChanged += 32 - GifPopCount((uint32_t)_mm256_movemask_epi8(same));
+    }
+    return ii;
+}
+#endif
+
+// Delta pass for frames of palette indices: writes the new index for changed pixels and
+// kGifTransIndex for unchanged ones. Since indexed images never use the transparency
+// index, the output doubles as the change mask. Returns the number of changed pixels.
+int GifDeltaIndices( const uint8_t* lastIndices, const uint8_t* indices, uint8_t* outIndices, int numPixels )
+{
+    GIF_SCOPE_TIMER(DELTA);
+    int numChanged = 0;
+    int ii = 0;
+
+#if defined(GIF_SIMD_AVX2)
+    if(gGifKernel >= GifKernelAVX2)
+        ii = GifDeltaIndicesAVX2(lastIndices, indices, outIndices, numPixels, &numChanged);
+#endif
+#if defined(GIF_SIMD_SSE2)
+    for(; gGifKernel >= GifKernelSSE2 && ii+16<=numPixels; ii+=16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i*)(lastIndices + ii));
+        __m128i b = _mm_loadu_si128((const __m128i*)(indices + ii));
+        __m128i same = _mm_cmpeq_epi8(a, b);
+        _mm_storeu_si128((__m128i*)(outIndices + ii), _mm_andnot_si128(same, b));
+        numChanged += 16 - GifPopCount((uint32_t)_mm_movemask_epi8(same));
+    }
+#endif
+
+    for(; ii<numPixels; ++ii)
+    {
+        bool changed = lastIndices[ii] != indices[ii];
+        outIndices[ii] = changed? indices[ii] : (uint8_t)kGifTransIndex;
+        numChanged += changed;
+    }
+
+    return numChanged;
+}
+
+// MSAA resolve for frames of ramp palette indices: averages each pixel's numSamples (2 or 4)
+// consecutive samples into one index. Ramp indices are linear in color, so this equals
+// averaging the samples' colors and snapping the result back onto the ramp.
+void GifResolveSamples( const uint8_t* samples, int numSamples, uint8_t* indices, int numPixels )
+{
+    GIF_SCOPE_TIMER(DELTA);
+    int ii = 0;
+
+#if defined(GIF_SIMD_SSE2)
+    // 16 pixels per iteration: add neighbouring bytes into 16-bit lanes (and for 4 samples
+    // neighbouring lanes into 32-bit ones), round, then pack back down to bytes
+    const __m128i lowBytes = _mm_set1_epi16(0x00ff);
+    if(gGifKernel < GifKernelSSE2)
+    {
+        // scalar reference below
+    }
+    else if(numSamples == 2)
+    {
+        const __m128i round = _mm_set1_epi16(1);
+        for(; ii+16<=numPixels; ii+=16)
+        {
+            __m128i sums[2];
+            for(int kk=0; kk<2; ++kk)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(samples + (ii+kk*8)*2));
+                __m128i sum = _mm_add_epi16(_mm_and_si128(v, lowBytes), _mm_srli_epi16(v, 8));
+                sums[kk] = _mm_srli_epi16(_mm_add_epi16(sum, round), 1);
+            }
+            _mm_storeu_si128((__m128i*)(indices + ii), _mm_packus_epi16(sums[0], sums[1]));
+        }
+    }
+    else if(numSamples == 4)
+    {
+        const __m128i ones = _mm_set1_epi16(1);
+        const __m128i round = _mm_set1_epi32(2);
+        for(; ii+16<=numPixels; ii+=16)
+        {
+            __m128i sums[4];
+            for(int kk=0; kk<4; ++kk)
+            {
+                __m128i v = _mm_loadu_si128((const __m128i*)(samples + (ii+kk*4)*4));
+                __m128i pairs = _mm_add_epi16(_mm_and_si128(v, lowBytes), _mm_srli_epi16(v, 8));
+                __m128i sum = _mm_madd_epi16(pairs, ones);
+                sums[kk] = _mm_srli_epi32(_mm_add_epi32(sum, round), 2);
+            }
+            __m128i lo = _mm_packs_epi32(sums[0], sums[1]);
+            __m128i hi = _mm_packs_epi32(sums[2], sums[3]);
+            _mm_storeu_si128((__m128i*)(indices + ii), _mm_packus_epi16(lo, hi));
+        }
+    }
+#endif
+
+    for(; ii<numPixels; ++ii)
+    {
+        int sum = 0;
+        for(int ss=0; ss<numSamples; ++ss)
+            sum += samples[ii*numSamples + ss];
+        indices[ii] = (uint8_t)((sum + numSamples/2) / numSamples);
+    }
+}
+
+// Index of the first nonzero byte in [begin, end), or end if there is none
+int GifFindNonZero( const uint8_t* bytes, int begin, int end )
+{
+    int ii = begin;
+#if defined(GIF_SIMD_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for(; gGifKernel >= GifKernelSSE2 && ii+16<=end; ii+=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bytes + ii));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            break;
+    }
+#endif
+    for(; ii<end; ++ii)
+        if(bytes[ii]) return ii;
+    return end;
+}
+
+// Index of the last nonzero byte in [begin, end), or begin-1 if there is none
+int GifFindLastNonZero( const uint8_t* bytes, int begin, int end )
+{
+    int ii = end;
+#if defined(GIF_SIMD_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    for(; gGifKernel >= GifKernelSSE2 && ii-16>=begin; ii-=16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(bytes + ii - 16));
+        if(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)) != 0xffff)
+            break;
+    }
+#endif
+    for(; ii>begin; --ii)
+        if(bytes[ii-1]) return ii-1;
+    return begin-1;
+}
+
+// Finds the bounding rectangle, in canvas space, of the nonzero entries of a change mask.
+// If nothing changed, a single pixel is returned so the frame (and its delay) is still written.
+void GifChangeBounds( const uint8_t* changeMask, uint32_t width, uint32_t height, uint32_t* left, uint32_t* top, uint32_t* rectWidth, uint32_t* rectHeight )
+{
+    int minX = (int)width, maxX = -1;
+    int minY = (int)height, maxY = -1;
+    for(int yy=0; yy<(int)height; ++yy)
+    {
+        const uint8_t* row = changeMask + (size_t)yy*width;
+        int first = GifFindNonZero(row, 0, (int)width);
+        if(first == (int)width) continue;
+
+        // only the parts of the row outside the current bounds can widen them
+        int last = GifFindLastNonZero(row, GifIMax(first, maxX+1), (int)width);
+        if(first < minX) minX = first;
+        if(last > maxX) maxX = last;
+        if(minY > yy) minY = yy;
+        maxY = yy;
+    }
+
+    if(maxY < 0)
+    {
+        *left = 0; *top = 0; *rectWidth = 1; *rectHeight = 1;
+        return;
+    }
+
+#ifdef GIF_FLIP_VERT
+    // bottom-left origin image: the mask's last row is the canvas' first
+    int flippedMinY = (int)height-1-maxY;
+    maxY = (int)height-1-minY;
+    minY = flippedMinY;
+#endif
+
+    *left = (uint32_t)minX;
+    *top = (uint32_t)minY;
+    *rectWidth = (uint32_t)(maxX-minX+1);
+    *rectHeight = (uint32_t)(maxY-minY+1);
+}
+
+// Locates the first pixel of a canvas-space rectangle within an image buffer, and the
+// signed distance in bytes between consecutive canvas rows
+const uint8_t* GifRectOrigin( const uint8_t* image, uint32_t pixelStride, uint32_t imageWidth, uint32_t imageHeight, uint32_t left, uint32_t top, int32_t* rowStride )
+{
+#ifdef GIF_FLIP_VERT
+    // bottom-left origin image (such as an OpenGL capture)
+    *rowStride = -(int32_t)(imageWidth*pixelStride);
+    return image + ((size_t)(imageHeight-1-top)*imageWidth + left)*pixelStride;
+#else
+    (void)imageHeight;
+    *rowStride = (int32_t)(imageWidth*pixelStride);
+    return image + ((size_t)top*imageWidth + left)*pixelStride;
+#endif
+}
+
 // walks the k-d tree to pick the palette entry for a desired color.
 // Takes as in/out parameters the current best color and its error -
 // only changes them if it finds a better color in its subtree.
@@ -134,88 +509,191 @@ void GifGetClosestPaletteColor( GifPalette* pPal, int r, int g, int b, int* best
     }
 }
 
-void GifSwapPixels(uint8_t* image, int pixA, int pixB)
+// The palette is built from a reduced-precision color histogram rather than from the pixels
+// themselves, so its cost after the single binning pass does not depend on the image size.
+// Each channel keeps GIF_HISTOGRAM_BITS bits; the bins store channel sums so palette entries
+// are still exact averages of the pixels they represent.
+#ifndef GIF_HISTOGRAM_BITS
+#define GIF_HISTOGRAM_BITS 6
+#endif
+
+const int kGifHistogramShift = 8 - GIF_HISTOGRAM_BITS;
+const int kGifHistogramBins = 1 << (GIF_HISTOGRAM_BITS * 3);
+
+typedef struct
+{
+    uint32_t* counts;    // pixels per bin
+    uint32_t* sums;      // r, g and b sums per bin (32 bits suffice up to 16M pixels per bin)
+    uint32_t* occupied;  // keys of the bins with a nonzero count, so clearing is proportional to them
+    int numOccupied;
+} GifHistogram;
+
+// A nonempty histogram bin, positioned at the average color of its pixels
+typedef struct
 {
-    uint8_t rA = image[pixA*4];
-    uint8_t gA = image[pixA*4+1];
-    uint8_t bA = image[pixA*4+2];
-    uint8_t aA = image[pixA*4+3];
+    uint8_t rgb[3];
+    uint8_t padding;    // make padding explicit
+    uint32_t count;
+    uint32_t sum[3];
+} GifColorBin;
 
-    uint8_t rB = image[pixB*4];
-    uint8_t gB = image[pixB*4+1];
-    uint8_t bB = image[pixB*4+2];
-    uint8_t aB = image[pixA*4+3];
+void GifAllocHistogram( GifHistogram* hist )
+{
+    hist->counts = (uint32_t*)GIF_MALLOC(sizeof(uint32_t) * (size_t)kGifHistogramBins);
+    hist->sums = (uint32_t*)GIF_MALLOC(sizeof(uint32_t) * 3 * (size_t)kGifHistogramBins);
+    hist->occupied = (uint32_t*)GIF_MALLOC(sizeof(uint32_t) * (size_t)kGifHistogramBins);
+    memset(hist->counts, 0, sizeof(uint32_t) * (size_t)kGifHistogramBins);
+    memset(hist->sums, 0, sizeof(uint32_t) * 3 * (size_t)kGifHistogramBins);
+    hist->numOccupied = 0;
+}
 
-    image[pixA*4] = rB;
-    image[pixA*4+1] = gB;
-    image[pixA*4+2] = bB;
-    image[pixA*4+3] = aB;
+void GifFreeHistogram( GifHistogram* hist )
+{
+    GIF_FREE(hist->counts);
+    GIF_FREE(hist->sums);
+    GIF_FREE(hist->occupied);
+    hist->counts = hist->sums = hist->occupied = NULL;
+}
 
-    image[pixB*4] = rA;
-    image[pixB*4+1] = gA;
-    image[pixB*4+2] = bA;
-    image[pixB*4+3] = aA;
+void GifAddToHistogram( GifHistogram* hist, const uint8_t* pixel )
+{
+    uint32_t key = ((uint32_t)(pixel[0] >> kGifHistogramShift) << (GIF_HISTOGRAM_BITS * 2)) |
+                   ((uint32_t)(pixel[1] >> kGifHistogramShift) << GIF_HISTOGRAM_BITS) |
+                    (uint32_t)(pixel[2] >> kGifHistogramShift);
+    if(hist->counts[key]++ == 0)
+        hist->occupied[hist->numOccupied++] = key;
+    hist->sums[key*3+0] += pixel[0];
+    hist->sums[key*3+1] += pixel[1];
+    hist->sums[key*3+2] += pixel[2];
 }
 
-// just the partition operation from quicksort
-int GifPartition(uint8_t* image, const int left, const int right, const int elt, int pivotValue)
+// Bins all pixels of the frame, or only the ones flagged in changeMask if it is not NULL,
+// so the palette is optimized for the colors of the changed pixels only.
+void GifHistogramChangedPixels( GifHistogram* hist, const uint8_t* changeMask, const uint8_t* frame, int numPixels )
 {
-    int storeIndex = left;
-    bool split = 0;
-    for(int ii=left; ii<right; ++ii)
+    if(!changeMask)
     {
-        int arrayVal = image[ii*4+elt];
-        if( arrayVal < pivotValue )
+        for(int ii=0; ii<numPixels; ++ii)
+            GifAddToHistogram(hist, frame + ii*4);
+        return;
+    }
+
+    for(int ii=GifFindNonZero(changeMask, 0, numPixels); ii<numPixels; ii=GifFindNonZero(changeMask, ii+1, numPixels))
+        GifAddToHistogram(hist, frame + ii*4);
+}
+
+// Moves the occupied bins into a compact list and resets the histogram for the next frame
+int GifCollectHistogram( GifHistogram* hist, GifColorBin* bins )
+{
+    for(int ii=0; ii<hist->numOccupied; ++ii)
+    {
+        uint32_t key = hist->occupied[ii];
+        GifColorBin* bin = bins + ii;
+        bin->count = hist->counts[key];
+        for(int cc=0; cc<3; ++cc)
         {
-            GifSwapPixels(image, ii, storeIndex);
-            ++storeIndex;
+            bin->sum[cc] = hist->sums[key*3+cc];
+            bin->rgb[cc] = (uint8_t)((bin->sum[cc] + bin->count/2) / bin->count);
+            hist->sums[key*3+cc] = 0;
         }
-        else if( arrayVal == pivotValue )
+        bin->padding = 0;
+        hist->counts[key] = 0;
+    }
+
+    int numBins = hist->numOccupied;
+    hist->numOccupied = 0;
+    return numBins;
+}
+
+// Moves the bins whose component com is below splitValue to the front, returning their count
+int GifPartitionBins( GifColorBin* bins, int numBins, int com, int splitValue )
+{
+    int storeIndex = 0;
+    for(int ii=0; ii<numBins; ++ii)
+    {
+        if(bins[ii].rgb[com] < splitValue)
         {
-            if(split)
-            {
-                GifSwapPixels(image, ii, storeIndex);
-                ++storeIndex;
-            }
-            split = !split;
+            GifColorBin tmp = bins[ii];
+            bins[ii] = bins[storeIndex];
+            bins[storeIndex] = tmp;
+            ++storeIndex;
         }
     }
     return storeIndex;
 }
 
-// Perform an incomplete sort, finding all elements above and below the desired median
-void GifPartitionByMedian(uint8_t* image, int left, int right, int com, int neededCenter)
-{
-    if(left < right-1)
-    {
-        int pivotValue = image[(neededCenter)*4+com];
-        GifSwapPixels(image, neededCenter, right-1);
-        int pivotIndex = GifPartition(image, left, right-1, com, pivotValue);
-        GifSwapPixels(image, pivotIndex, right-1);
+// Subtrees this close to the root are handed to helper threads when they hold enough bins
+#ifndef GIF_PALETTE_PARALLEL_LEVELS
+#define GIF_PALETTE_PARALLEL_LEVELS 2
+#endif
+const int kGifParallelMinBins = 2048;
 
-        // Only "sort" the section of the array that contains the median
-        if(pivotIndex > neededCenter)
-            GifPartitionByMedian(image, left, pivotIndex, com, neededCenter);
+void GifSplitPalette(GifColorBin* bins, int numBins, int treeNode, int treeLevel, bool buildForDither, GifPalette* pal);
 
-        if(pivotIndex < neededCenter)
-            GifPartitionByMedian(image, pivotIndex+1, right, com, neededCenter);
-    }
-}
+#ifndef GIF_NO_THREADS
+// Helper threads for palette subtrees, one set for the whole process: they are started once,
+// so frames do not create threads, and every writer shares them, so many writers encoding at
+// once do not oversubscribe the CPU. GIF_PALETTE_THREADS defaults to one less than the
+// hardware threads; a writer runs any subtree no helper has picked up itself.
+#ifndef GIF_PALETTE_THREADS
+#define GIF_PALETTE_THREADS ((int)std::thread::hardware_concurrency() - 1)
+#endif
 
-// Just partition around a given pivot, returning the split point
-int GifPartitionByMean(uint8_t* image, int left, int right, int com, int neededMean)
+typedef struct
 {
-    if(left < right-1)
+    GifColorBin* bins;
+    int numBins;
+    int treeNode;
+    int treeLevel;
+    bool buildForDither;
+    bool done;
+    GifPalette* pal;
+} GifPaletteTask;
+
+struct GifPaletteHelpers
+{
+    std::mutex mutex;
+    std::condition_variable changed;
+    std::deque<GifPaletteTask*> queue;
+    int threads;
+
+    static void Run( GifPaletteHelpers* helpers )
     {
-        return GifPartition(image, left, right-1, com, neededMean);
+        std::unique_lock<std::mutex> lock(helpers->mutex);
+        while(true)
+        {
+            helpers->changed.wait(lock, [helpers] { return !helpers->queue.empty(); });
+            GifPaletteTask* task = helpers->queue.front();
+            helpers->queue.pop_front();
+            lock.unlock();
+            GifSplitPalette(task->bins, task->numBins, task->treeNode, task->treeLevel, task->buildForDither, task->pal);
+            lock.lock();
+            task->done = true;
+            helpers->changed.notify_all();
+        }
     }
-    return left;
+};
+
+// started by the first parallel split and never stopped, so helpers outlive every writer
+GifPaletteHelpers* GifGetPaletteHelpers()
+{
+    static GifPaletteHelpers* helpers = []
+    {
+        GifPaletteHelpers* created = new GifPaletteHelpers();
+        created->threads = GifIMax(GIF_PALETTE_THREADS, 0);
+        for(int ii=0; ii<created->threads; ++ii)
+            std::thread(GifPaletteHelpers::Run, created).detach();
+        return created;
+    }();
+    return helpers;
 }
+#endif
 
-// Builds a palette by creating a balanced k-d tree of all pixels in the image
-void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel, bool buildForDither, GifPalette* pal)
+// Builds a palette by creating a balanced k-d tree of the histogram bins, splitting at the
+// pixel-weighted median
+void GifSplitPalette(GifColorBin* bins, int numBins, int treeNode, int treeLevel, bool buildForDither, GifPalette* pal)
 {
-    if(numPixels == 0)
+    if(numBins == 0)
         return;
 
     int numColors = (1 << pal->bitDepth);
@@ -230,171 +708,155 @@ void GifSplitPalette(uint8_t* image, int numPixels, int treeNode, int treeLevel,
             // Dithering needs at least one color as dark as anything
             // in the image and at least one brightest color -
             // otherwise it builds up error and produces strange artifacts
-            if( entry == 1 )
+            if( entry == 1 || entry == numColors-1 )
             {
-                // special case: the darkest color in the image
-                uint32_t r=255, g=255, b=255;
-                for(int ii=0; ii<numPixels; ++ii)
+                // special case: the darkest (or lightest) color in the image
+                bool darkest = entry == 1;
+                int rgb[3];
+                for(int cc=0; cc<3; ++cc)
                 {
-                    r = (uint32_t)GifIMin((int32_t)r, image[ii * 4 + 0]);
-                    g = (uint32_t)GifIMin((int32_t)g, image[ii * 4 + 1]);
-                    b = (uint32_t)GifIMin((int32_t)b, image[ii * 4 + 2]);
+                    rgb[cc] = darkest? 255 : 0;
+                    for(int ii=0; ii<numBins; ++ii)
+                        rgb[cc] = darkest? GifIMin(rgb[cc], bins[ii].rgb[cc]) : GifIMax(rgb[cc], bins[ii].rgb[cc]);
                 }
 
-                pal->r[entry] = (uint8_t)r;
-                pal->g[entry] = (uint8_t)g;
-                pal->b[entry] = (uint8_t)b;
-
-                return;
-            }
-
-            if( entry == numColors-1 )
-            {
-                // special case: the lightest color in the image
-                uint32_t r=0, g=0, b=0;
-                for(int ii=0; ii<numPixels; ++ii)
-                {
-                    r = (uint32_t)GifIMax((int32_t)r, image[ii * 4 + 0]);
-                    g = (uint32_t)GifIMax((int32_t)g, image[ii * 4 + 1]);
-                    b = (uint32_t)GifIMax((int32_t)b, image[ii * 4 + 2]);
-                }
-
-                pal->r[entry] = (uint8_t)r;
-                pal->g[entry] = (uint8_t)g;
-                pal->b[entry] = (uint8_t)b;
+                pal->r[entry] = (uint8_t)rgb[0];
+                pal->g[entry] = (uint8_t)rgb[1];
+                pal->b[entry] = (uint8_t)rgb[2];
 
                 return;
             }
         }
 
         // otherwise, take the average of all colors in this subcube
-        uint64_t r=0, g=0, b=0;
-        for(int ii=0; ii<numPixels; ++ii)
+        uint64_t r=0, g=0, b=0, count=0;
+        for(int ii=0; ii<numBins; ++ii)
         {
-            r += image[ii*4+0];
-            g += image[ii*4+1];
-            b += image[ii*4+2];
+            r += bins[ii].sum[0];
+            g += bins[ii].sum[1];
+            b += bins[ii].sum[2];
+            count += bins[ii].count;
         }
 
-        r += (uint64_t)numPixels / 2;  // round to nearest
-        g += (uint64_t)numPixels / 2;
-        b += (uint64_t)numPixels / 2;
-
-        r /= (uint64_t)numPixels;
-        g /= (uint64_t)numPixels;
-        b /= (uint64_t)numPixels;
+        r += count / 2;  // round to nearest
+        g += count / 2;
+        b += count / 2;
 
-        pal->r[entry] = (uint8_t)r;
-        pal->g[entry] = (uint8_t)g;
-        pal->b[entry] = (uint8_t)b;
+        pal->r[entry] = (uint8_t)(r / count);
+        pal->g[entry] = (uint8_t)(g / count);
+        pal->b[entry] = (uint8_t)(b / count);
 
         return;
     }
 
     // Find the axis with the largest range
-    int minR = 255, maxR = 0;
-    int minG = 255, maxG = 0;
-    int minB = 255, maxB = 0;
-    for(int ii=0; ii<numPixels; ++ii)
+    int minC[3] = {255, 255, 255};
+    int maxC[3] = {0, 0, 0};
+    uint64_t totalCount = 0;
+    for(int ii=0; ii<numBins; ++ii)
     {
-        int r = image[ii*4+0];
-        int g = image[ii*4+1];
-        int b = image[ii*4+2];
-
-        if(r > maxR) maxR = r;
-        if(r < minR) minR = r;
-
-        if(g > maxG) maxG = g;
-        if(g < minG) minG = g;
-
-        if(b > maxB) maxB = b;
-        if(b < minB) minB = b;
+        for(int cc=0; cc<3; ++cc)
+        {
+            int v = bins[ii].rgb[cc];
+            if(v > maxC[cc]) maxC[cc] = v;
+            if(v < minC[cc]) minC[cc] = v;
+        }
+        totalCount += bins[ii].count;
     }
 
-    int rRange = maxR - minR;
-    int gRange = maxG - minG;
-    int bRange = maxB - minB;
+    int rRange = maxC[0] - minC[0];
+    int gRange = maxC[1] - minC[1];
+    int bRange = maxC[2] - minC[2];
 
     // and split along that axis. (incidentally, this means this isn't a "proper" k-d tree but I don't know what else to call it)
-    int splitCom = 1; int rangeMin = minG; int rangeMax = maxG;
-    if(bRange > gRange) { splitCom = 2; rangeMin = minB; rangeMax = maxB; }
-    if(rRange > bRange && rRange > gRange) { splitCom = 0; rangeMin = minR; rangeMax = maxR; }
-
-    int subPixelsA = numPixels / 2;
-
-    GifPartitionByMedian(image, 0, numPixels, splitCom, subPixelsA);
-    int splitValue = image[subPixelsA*4+splitCom];
+    int splitCom = 1;
+    if(bRange > gRange) splitCom = 2;
+    if(rRange > bRange && rRange > gRange) splitCom = 0;
+    int rangeMin = minC[splitCom]; int rangeMax = maxC[splitCom];
+
+    // weighted median: the first value above which at most half the pixels lie
+    uint64_t weights[256];
+    memset(weights, 0, sizeof(weights));
+    for(int ii=0; ii<numBins; ++ii)
+        weights[bins[ii].rgb[splitCom]] += bins[ii].count;
+
+    int splitValue = rangeMin;
+    uint64_t below = 0;
+    while(splitValue < rangeMax && below + weights[splitValue] <= totalCount / 2)
+        below += weights[splitValue++];
+    if(splitValue == rangeMin && rangeMax > rangeMin)
+        splitValue = rangeMin + 1;  // keep both sides nonempty
 
     // if the split is very unbalanced, split at the mean instead of the median to preserve rare colors
     int splitUnbalance = GifIAbs( (splitValue - rangeMin) - (rangeMax - splitValue) );
     if( splitUnbalance > (1536 >> treeLevel) )
-    {
-        splitValue = rangeMin + (rangeMax-rangeMin) / 2;
-        subPixelsA = GifPartitionByMean(image, 0, numPixels, splitCom, splitValue);
-    }
+        splitValue = rangeMin + (rangeMax-rangeMin) / 2 + 1;
+
+    int subBinsA = GifPartitionBins(bins, numBins, splitCom, splitValue);
 
     // add the bottom node for the transparency index
     if( treeNode == numColors/2 )
     {
-        subPixelsA = 0;
+        subBinsA = 0;
         splitValue = 0;
     }
 
-    int subPixelsB = numPixels-subPixelsA;
+    int subBinsB = numBins-subBinsA;
     pal->treeSplitElt[treeNode] = (uint8_t)splitCom;
     pal->treeSplit[treeNode] = (uint8_t)splitValue;
 
-    GifSplitPalette(image,              subPixelsA, treeNode*2,   treeLevel+1, buildForDither, pal);
-    GifSplitPalette(image+subPixelsA*4, subPixelsB, treeNode*2+1, treeLevel+1, buildForDither, pal);
-}
-
-// Finds all pixels that have changed from the previous image and
-// moves them to the fromt of th buffer.
-// This allows us to build a palette optimized for the colors of the
-// changed pixels only.
-int GifPickChangedPixels( const uint8_t* lastFrame, uint8_t* frame, int numPixels )
-{
-    int numChanged = 0;
-    uint8_t* writeIter = frame;
-
-    for (int ii=0; ii<numPixels; ++ii)
+#ifndef GIF_NO_THREADS
+    // the two subtrees write disjoint tree nodes and palette entries, so they can be built concurrently
+    GifPaletteHelpers* helpers = treeLevel < GIF_PALETTE_PARALLEL_LEVELS && subBinsA >= kGifParallelMinBins && subBinsB >= kGifParallelMinBins
+        ? GifGetPaletteHelpers() : NULL;
+    if(helpers && helpers->threads > 0)
     {
-        if(lastFrame[0] != frame[0] ||
-           lastFrame[1] != frame[1] ||
-           lastFrame[2] != frame[2])
+        GifPaletteTask left = { bins, subBinsA, treeNode*2, treeLevel+1, buildForDither, false, pal };
+        {
+            std::lock_guard<std::mutex> lock(helpers->mutex);
+            helpers->queue.push_back(&left);
+        }
+        helpers->changed.notify_all();
+        GifSplitPalette(bins+subBinsA, subBinsB, treeNode*2+1, treeLevel+1, buildForDither, pal);
+
+        // take the left subtree back if every helper is busy, otherwise wait for it
+        std::unique_lock<std::mutex> lock(helpers->mutex);
+        std::deque<GifPaletteTask*>::iterator queued = std::find(helpers->queue.begin(), helpers->queue.end(), &left);
+        if(queued != helpers->queue.end())
         {
-            writeIter[0] = frame[0];
-            writeIter[1] = frame[1];
-            writeIter[2] = frame[2];
-            ++numChanged;
-            writeIter += 4;
+            helpers->queue.erase(queued);
+            lock.unlock();
+            GifSplitPalette(bins, subBinsA, treeNode*2, treeLevel+1, buildForDither, pal);
+            return;
         }
-        lastFrame += 4;
-        frame += 4;
+        helpers->changed.wait(lock, [&left] { return left.done; });
+        return;
     }
+#endif
 
-    return numChanged;
+    GifSplitPalette(bins,          subBinsA, treeNode*2,   treeLevel+1, buildForDither, pal);
+    GifSplitPalette(bins+subBinsA, subBinsB, treeNode*2+1, treeLevel+1, buildForDither, pal);
 }
 
-// Creates a palette by placing all the image pixels in a k-d tree and then averaging the blocks at the bottom.
+// Creates a palette by binning the image pixels into a color histogram, placing the bins in a
+// k-d tree and then averaging the blocks at the bottom.
 // This is known as the "median split" technique
-void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifPalette* pPal )
+void GifMakePalette( const uint8_t* changeMask, const uint8_t* nextFrame, uint32_t width, uint32_t height, int bitDepth, bool buildForDither, GifHistogram* hist, GifPalette* pPal )
 {
+    GIF_SCOPE_TIMER(PALETTE);
+    // entries under empty subtrees are never assigned a color; keep them deterministic
+    memset(pPal, 0, sizeof(GifPalette));
     pPal->bitDepth = bitDepth;
 
-    // SplitPalette is destructive (it sorts the pixels by color) so
-    // we must create a copy of the image for it to destroy
-    size_t imageSize = (size_t)(width * height * 4 * sizeof(uint8_t));
-    uint8_t* destroyableImage = (uint8_t*)GIF_TEMP_MALLOC(imageSize);
-    memcpy(destroyableImage, nextFrame, imageSize);
+    GifHistogramChangedPixels(hist, changeMask, nextFrame, (int)(width * height));
 
-    int numPixels = (int)(width * height);
-    if(lastFrame)
-        numPixels = GifPickChangedPixels(lastFrame, destroyableImage, numPixels);
+    // SplitPalette is destructive (it sorts the bins by color) so it works on a compact copy
+    GifColorBin* bins = (GifColorBin*)GIF_TEMP_MALLOC(sizeof(GifColorBin) * (size_t)GifIMax(hist->numOccupied, 1));
+    int numBins = GifCollectHistogram(hist, bins);
 
-    GifSplitPalette(destroyableImage, numPixels, 1, 0, buildForDither, pPal);
+    GifSplitPalette(bins, numBins, 1, 0, buildForDither, pPal);
 
-    GIF_TEMP_FREE(destroyableImage);
+    GIF_TEMP_FREE(bins);
 
     // add the bottom node for the transparency index
     pPal->treeSplit[1 << (bitDepth-1)] = 0;
@@ -403,9 +865,34 @@ void GifMakePalette( const uint8_t* lastFrame, const uint8_t* nextFrame, uint32_
     pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
 }
 
+// Creates a fixed palette ramping linearly from black to the given color over entries
+// 1..(2^bitDepth)-1. Entry 0 stays reserved for transparency. Images rendered directly as
+// ramp indices can be written with GifWriteFrameIndexed without any quantization.
+void GifMakeRampPalette( uint8_t r, uint8_t g, uint8_t b, int bitDepth, GifPalette* pPal )
+{
+    pPal->bitDepth = bitDepth;
+
+    int numColors = (1 << bitDepth);
+    int lastLevel = GifIMax(numColors - 2, 1);
+
+    pPal->r[0] = pPal->g[0] = pPal->b[0] = 0;
+    for(int ii=1; ii<numColors; ++ii)
+    {
+        int level = ii - 1;
+        pPal->r[ii] = (uint8_t)((r * level + lastLevel / 2) / lastLevel);
+        pPal->g[ii] = (uint8_t)((g * level + lastLevel / 2) / lastLevel);
+        pPal->b[ii] = (uint8_t)((b * level + lastLevel / 2) / lastLevel);
+    }
+
+    // the k-d tree is only needed to search for colors, which indexed frames never do
+    memset(pPal->treeSplitElt, 0, sizeof(pPal->treeSplitElt));
+    memset(pPal->treeSplit, 0, sizeof(pPal->treeSplit));
+}
+
 // Implements Floyd-Steinberg dithering, writes palette value to alpha
 void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
 {
+    GIF_SCOPE_TIMER(THRESHOLD);
     int numPixels = (int)(width * height);
 
     // quantPixels initially holds color*256 for all pixels
@@ -512,22 +999,176 @@ void GifDitherImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t
     GIF_TEMP_FREE(quantPixels);
 }
 
-// Picks palette colors for the image using simple thresholding, no dithering
-void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+// Palettizes one changed pixel for the SIMD thresholding kernels, reusing the previous
+// lookup when the color repeats. lastRgb holds the previous color as r | g<<8 | b<<16 (or
+// 0xffffffff before the first lookup) and lastOut the pixel written for it, in the same
+// byte order.
+void GifThresholdPixel( const uint8_t* nextFrame, uint8_t* outFrame, GifPalette* pPal, uint32_t* lastRgb, uint32_t* lastOut )
+{
+    uint32_t rgb = (uint32_t)nextFrame[0] | ((uint32_t)nextFrame[1] << 8) | ((uint32_t)nextFrame[2] << 16);
+    if(rgb != *lastRgb)
+    {
+        int32_t bestDiff = 1000000;
+        int32_t bestInd = 1;
+        GifGetClosestPaletteColor(pPal, nextFrame[0], nextFrame[1], nextFrame[2], &bestInd, &bestDiff, 1);
+        *lastRgb = rgb;
+        *lastOut = (uint32_t)pPal->r[bestInd] | ((uint32_t)pPal->g[bestInd] << 8) | ((uint32_t)pPal->b[bestInd] << 16) | ((uint32_t)bestInd << 24);
+    }
+    outFrame[0] = (uint8_t)*lastOut;
+    outFrame[1] = (uint8_t)(*lastOut >> 8);
+    outFrame[2] = (uint8_t)(*lastOut >> 16);
+    outFrame[3] = (uint8_t)(*lastOut >> 24);
+}
+
+// The SIMD thresholding kernels work on blocks of pixels: a block whose pixels are all
+// unchanged only has its alpha cleared, and a changed block of the color looked up last is
+// filled with one store. Rendered frames are mostly such runs. Other blocks go pixel by
+// pixel. Every lookup is the same k-d tree search as the scalar kernel, so the output is
+// identical.
+#if defined(GIF_SIMD_SSE2)
+void GifThresholdImageSSE2( const uint8_t* changeMask, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t numPixels, GifPalette* pPal )
+{
+    const __m128i rgbMask = _mm_set1_epi32(0x00ffffff);
+    const __m128i transAlpha = _mm_set1_epi32((int)((uint32_t)kGifTransIndex << 24));
+    const __m128i zero = _mm_setzero_si128();
+    uint32_t lastRgb = 0xffffffffu;
+    uint32_t lastOut = 0;
+    uint32_t ii = 0;
+    for(; ii+16<=numPixels; ii+=16)
+    {
+        int unchanged = 0;
+        if(changeMask)
+            unchanged = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(changeMask + ii)), zero));
+        if(unchanged == 0xffff)
+        {
+            for(int kk=0; kk<4; ++kk)
+            {
+                __m128i* out = (__m128i*)(outFrame + (ii+kk*4)*4);
+                _mm_storeu_si128(out, _mm_or_si128(_mm_and_si128(_mm_loadu_si128(out), rgbMask), transAlpha));
+            }
+            continue;
+        }
+        if(unchanged == 0)
+        {
+            const __m128i last = _mm_set1_epi32((int)lastRgb);
+            int same = 0xffff;
+            for(int kk=0; kk<4; ++kk)
+            {
+                __m128i rgb = _mm_and_si128(_mm_loadu_si128((const __m128i*)(nextFrame + (ii+kk*4)*4)), rgbMask);
+                same &= _mm_movemask_epi8(_mm_cmpeq_epi32(rgb, last));
+            }
+            if(same == 0xffff)
+            {
+                const __m128i fill = _mm_set1_epi32((int)lastOut);
+                for(int kk=0; kk<4; ++kk)
+                    _mm_storeu_si128((__m128i*)(outFrame + (ii+kk*4)*4), fill);
+                continue;
+            }
+        }
+        for(uint32_t jj=ii; jj<ii+16; ++jj)
+        {
+            if(changeMask && !changeMask[jj])
+                outFrame[jj*4+3] = kGifTransIndex;
+            else
+                GifThresholdPixel(nextFrame + jj*4, outFrame + jj*4, pPal, &lastRgb, &lastOut);
+        }
+    }
+    for(; ii<numPixels; ++ii)
+    {
+        if(changeMask && !changeMask[ii])
+            outFrame[ii*4+3] = kGifTransIndex;
+        else
+            GifThresholdPixel(nextFrame + ii*4, outFrame + ii*4, pPal, &lastRgb, &lastOut);
+    }
+}
+#endif
+
+#if defined(GIF_SIMD_AVX2)
+GIF_TARGET_AVX2 void GifThresholdImageAVX2( const uint8_t* changeMask, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t numPixels, GifPalette* pPal )
 {
+    const __m256i rgbMask = _mm256_set1_epi32(0x00ffffff);
+    const __m256i transAlpha = _mm256_set1_epi32((int)((uint32_t)kGifTransIndex << 24));
+    const __m256i zero = _mm256_setzero_si256();
+    uint32_t lastRgb = 0xffffffffu;
+    uint32_t lastOut = 0;
+    uint32_t ii = 0;
+    for(; ii+32<=numPixels; ii+=32)
+    {
+        uint32_t unchanged = 0;
+        if(changeMask)
+            unchanged = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(changeMask + ii)), zero));
+        if(unchanged == 0xffffffffu)
+        {
+            for(int kk=0; kk<4; ++kk)
+            {
+                __m256i* out = (__m256i*)(outFrame + (ii+kk*8)*4);
+                _mm256_storeu_si256(out, _mm256_or_si256(_mm256_and_si256(_mm256_loadu_si256(out), rgbMask), transAlpha));
+            }
+            continue;
+        }
+        if(unchanged == 0)
+        {
+            const __m256i last = _mm256_set1_epi32((int)lastRgb);
+            uint32_t same = 0xffffffffu;
+            for(int kk=0; kk<4; ++kk)
+            {
+                __m256i rgb = _mm256_and_si256(_mm256_loadu_si256((const __m256i*)(nextFrame + (ii+kk*8)*4)), rgbMask);
+                same &= (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi32(rgb, last));
+            }
+            if(same == 0xffffffffu)
+            {
+                const __m256i fill = _mm256_set1_epi32((int)lastOut);
+                for(int kk=0; kk<4; ++kk)
+                    _mm256_storeu_si256((__m256i*)(outFrame + (ii+kk*8)*4), fill);
+                continue;
+            }
+        }
+        for(uint32_t jj=ii; jj<ii+32; ++jj)
+        {
+            if(changeMask && !changeMask[jj])
+                outFrame[jj*4+3] = kGifTransIndex;
+            else
+                GifThresholdPixel(nextFrame + jj*4, outFrame + jj*4, pPal, &lastRgb, &lastOut);
+        }
+    }
+    for(; ii<numPixels; ++ii)
+    {
+        if(changeMask && !changeMask[ii])
+            outFrame[ii*4+3] = kGifTransIndex;
+        else
+            GifThresholdPixel(nextFrame + ii*4, outFrame + ii*4, pPal, &lastRgb, &lastOut);
+    }
+}
+#endif
+
+// Picks palette colors for the image using simple thresholding, no dithering.
+// outFrame holds the previous frame; pixels not flagged in changeMask keep its color
+// and become transparent. Pass a NULL mask to palettize every pixel.
+void GifThresholdImage( const uint8_t* changeMask, const uint8_t* nextFrame, uint8_t* outFrame, uint32_t width, uint32_t height, GifPalette* pPal )
+{
+    GIF_SCOPE_TIMER(THRESHOLD);
     uint32_t numPixels = width*height;
+#if defined(GIF_SIMD_AVX2)
+    if(gGifKernel >= GifKernelAVX2)
+    {
+        GifThresholdImageAVX2(changeMask, nextFrame, outFrame, numPixels, pPal);
+        return;
+    }
+#endif
+#if defined(GIF_SIMD_SSE2)
+    if(gGifKernel >= GifKernelSSE2)
+    {
+        GifThresholdImageSSE2(changeMask, nextFrame, outFrame, numPixels, pPal);
+        return;
+    }
+#endif
+
+    // scalar reference: one tree search per changed pixel
     for( uint32_t ii=0; ii<numPixels; ++ii )
     {
-        // if a previous color is available, and it matches the current color,
-        // set the pixel to transparent
-        if(lastFrame &&
-           lastFrame[0] == nextFrame[0] &&
-           lastFrame[1] == nextFrame[1] &&
-           lastFrame[2] == nextFrame[2])
+        // if the pixel matches the previous frame's color, set it to transparent
+        if(changeMask && !changeMask[ii])
         {
-            outFrame[0] = lastFrame[0];
-            outFrame[1] = lastFrame[1];
-            outFrame[2] = lastFrame[2];
             outFrame[3] = kGifTransIndex;
         }
         else
@@ -544,18 +1185,154 @@ void GifThresholdImage( const uint8_t* lastFrame, const uint8_t* nextFrame, uint
             outFrame[3] = (uint8_t)bestInd;
         }
 
-        if(lastFrame) lastFrame += 4;
         outFrame += 4;
         nextFrame += 4;
     }
 }
 
+// Destination of the encoded bytes. write is handed buffered chunks and returns false on
+// failure, after which the sink stays failed and drops further output.
+// Besides files, sinks can write to a file descriptor (GifFdWrite, e.g. stdout or a pipe),
+// to a growable GifMemoryBuffer (GifMemoryWrite), or to any user callback.
+typedef bool (*GifWriteFn)( void* context, const uint8_t* data, size_t size );
+
+typedef struct
+{
+    GifWriteFn write;
+    void* context;
+    bool failed;
+    bool counted;          // bytes count as BYTES_WRITTEN; off for the writer's own staging buffers
+
+    uint8_t padding[2];    // make padding explicit
+    uint32_t used;
+    uint8_t buffer[4096];
+} GifSink;
+
+void GifSinkInit( GifSink* sink, GifWriteFn write, void* context )
+{
+    sink->write = write;
+    sink->context = context;
+    sink->failed = false;
+    sink->counted = true;
+    sink->used = 0;
+}
+
+// every write of a sink goes through here, whatever its backend
+void GifSinkWrite( GifSink* sink, const uint8_t* data, size_t size )
+{
+    if(sink->failed) return;
+    sink->failed = !sink->write(sink->context, data, size);
+    if(sink->counted && !sink->failed)
+    {
+        GIF_COUNT(BYTES_WRITTEN, size);
+    }
+}
+
+// hands all buffered bytes to the sink's write function
+bool GifSinkFlush( GifSink* sink )
+{
+    if(sink->used)
+        GifSinkWrite(sink, sink->buffer, sink->used);
+    sink->used = 0;
+    return !sink->failed;
+}
+
+void GifPutc( GifSink* sink, int c )
+{
+    if(sink->used == sizeof(sink->buffer))
+        GifSinkFlush(sink);
+    sink->buffer[sink->used++] = (uint8_t)c;
+}
+
+void GifPutBytes( GifSink* sink, const uint8_t* data, size_t size )
+{
+    if(sink->used + size > sizeof(sink->buffer))
+    {
+        GifSinkFlush(sink);
+        if(size > sizeof(sink->buffer))
+        {
+            GifSinkWrite(sink, data, size);
+            return;
+        }
+    }
+    memcpy(sink->buffer + sink->used, data, size);
+    sink->used += (uint32_t)size;
+}
+
+void GifPuts( GifSink* sink, const char* str )
+{
+    GifPutBytes(sink, (const uint8_t*)str, strlen(str));
+}
+
+// context is the FILE*; stdio buffers the chunks, see GifFlushPendingFrame
+bool GifFileWrite( void* context, const uint8_t* data, size_t size )
+{
+    GIF_SCOPE_TIMER(IO);
+    FILE* f = (FILE*)context;
+    return fwrite(data, 1, size, f) == size;
+}
+
+// context is the file descriptor, cast with GifFdContext
+void* GifFdContext( int fd ) { return (void*)(intptr_t)fd; }
+
+bool GifFdWrite( void* context, const uint8_t* data, size_t size )
+{
+    GIF_SCOPE_TIMER(IO);
+    int fd = (int)(intptr_t)context;
+    while(size > 0)
+    {
+#ifdef _WIN32
+        int written = _write(fd, data, (unsigned int)size);
+#else
+        ssize_t written = write(fd, data, size);
+        if(written < 0 && errno == EINTR) continue;
+#endif
+        if(written <= 0) return false;
+        data += written;
+        size -= (size_t)written;
+    }
+    return true;
+}
+
+// A growable in-memory sink. Start zero-initialized and release with GifFreeMemoryBuffer.
+typedef struct
+{
+    uint8_t* data;
+    size_t size;
+    size_t capacity;
+} GifMemoryBuffer;
+
+// context is the GifMemoryBuffer*
+bool GifMemoryWrite( void* context, const uint8_t* data, size_t size )
+{
+    GifMemoryBuffer* buffer = (GifMemoryBuffer*)context;
+    if(buffer->size + size > buffer->capacity)
+    {
+        size_t capacity = buffer->capacity? buffer->capacity : 4096;
+        while(capacity < buffer->size + size) capacity *= 2;
+        uint8_t* grown = (uint8_t*)GIF_REALLOC(buffer->data, capacity);
+        if(!grown) return false;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return true;
+}
+
+void GifFreeMemoryBuffer( GifMemoryBuffer* buffer )
+{
+    GIF_FREE(buffer->data);
+    buffer->data = NULL;
+    buffer->size = buffer->capacity = 0;
+}
+
 // Simple structure to write out the LZW-compressed portion of the image
 // one bit at a time
 typedef struct
 {
     uint32_t chunkIndex;
-    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the file
+    uint8_t chunk[256];   // bytes are written in here until we have 256 of them, then written to the sink
 
     uint8_t bitIndex;  // how many bits in the partial byte written so far
     uint8_t byte;      // current partial byte
@@ -581,18 +1358,18 @@ void GifWriteBit( GifBitStatus* stat, uint32_t bit )
     }
 }
 
-// write all bytes so far to the file
-void GifWriteChunk( FILE* f, GifBitStatus* stat )
+// write all bytes so far to the sink
+void GifWriteChunk( GifSink* sink, GifBitStatus* stat )
 {
-    fputc((int)stat->chunkIndex, f);
-    fwrite(stat->chunk, 1, stat->chunkIndex, f);
+    GifPutc(sink, (int)stat->chunkIndex);
+    GifPutBytes(sink, stat->chunk, stat->chunkIndex);
 
     stat->bitIndex = 0;
     stat->byte = 0;
     stat->chunkIndex = 0;
 }
 
-void GifWriteCode( FILE* f, GifBitStatus* stat, uint32_t code, uint32_t length )
+void GifWriteCode( GifSink* sink, GifBitStatus* stat, uint32_t code, uint32_t length )
 {
     for( uint32_t ii=0; ii<length; ++ii )
     {
@@ -601,7 +1378,7 @@ void GifWriteCode( FILE* f, GifBitStatus* stat, uint32_t code, uint32_t length )
 
         if( stat->chunkIndex == 255 )
         {
-            GifWriteChunk(f, stat);
+            GifWriteChunk(sink, stat);
         }
     }
 }
@@ -613,12 +1390,12 @@ typedef struct
     uint16_t m_next[256];
 } GifLzwNode;
 
-// write a 256-color (8-bit) image palette to the file
-void GifWritePalette( const GifPalette* pPal, FILE* f )
+// write a 256-color (8-bit) image palette to the sink
+void GifWritePalette( const GifPalette* pPal, GifSink* sink )
 {
-    fputc(0, f);  // first color: transparency
-    fputc(0, f);
-    fputc(0, f);
+    GifPutc(sink, 0);  // first color: transparency
+    GifPutc(sink, 0);
+    GifPutc(sink, 0);
 
     for(int ii=1; ii<(1 << pPal->bitDepth); ++ii)
     {
@@ -626,47 +1403,51 @@ void GifWritePalette( const GifPalette* pPal, FILE* f )
         uint32_t g = pPal->g[ii];
         uint32_t b = pPal->b[ii];
 
-        fputc((int)r, f);
-        fputc((int)g, f);
-        fputc((int)b, f);
+        GifPutc(sink, (int)r);
+        GifPutc(sink, (int)g);
+        GifPutc(sink, (int)b);
     }
 }
 
 // write the image header, LZW-compress and write out the image
-void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, GifPalette* pPal)
+// indices points at the rectangle's top-left pixel; the palette index of each pixel is read
+// from indices[yy*rowStride + xx*pixelStride]. This lets the same encoder consume both RGBA
+// buffers (index in alpha) and packed 8-bit index buffers, and encode sub-rectangles of them.
+void GifWriteLzwImage(GifSink* sink, const uint8_t* indices, uint32_t pixelStride, int32_t rowStride, uint32_t left, uint32_t top,  uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal)
 {
+    GIF_SCOPE_TIMER(LZW);
     // graphics control extension
-    fputc(0x21, f);
-    fputc(0xf9, f);
-    fputc(0x04, f);
-    fputc(0x05, f); // leave prev frame in place, this frame has transparency
-    fputc(delay & 0xff, f);
-    fputc((delay >> 8) & 0xff, f);
-    fputc(kGifTransIndex, f); // transparent color index
-    fputc(0, f);
+    GifPutc(sink, 0x21);
+    GifPutc(sink, 0xf9);
+    GifPutc(sink, 0x04);
+    GifPutc(sink, 0x05); // leave prev frame in place, this frame has transparency
+    GifPutc(sink, delay & 0xff);
+    GifPutc(sink, (delay >> 8) & 0xff);
+    GifPutc(sink, kGifTransIndex); // transparent color index
+    GifPutc(sink, 0);
 
-    fputc(0x2c, f); // image descriptor block
+    GifPutc(sink, 0x2c); // image descriptor block
 
-    fputc(left & 0xff, f);           // corner of image in canvas space
-    fputc((left >> 8) & 0xff, f);
-    fputc(top & 0xff, f);
-    fputc((top >> 8) & 0xff, f);
+    GifPutc(sink, left & 0xff);           // corner of image in canvas space
+    GifPutc(sink, (left >> 8) & 0xff);
+    GifPutc(sink, top & 0xff);
+    GifPutc(sink, (top >> 8) & 0xff);
 
-    fputc(width & 0xff, f);          // width and height of image
-    fputc((width >> 8) & 0xff, f);
-    fputc(height & 0xff, f);
-    fputc((height >> 8) & 0xff, f);
+    GifPutc(sink, width & 0xff);          // width and height of image
+    GifPutc(sink, (width >> 8) & 0xff);
+    GifPutc(sink, height & 0xff);
+    GifPutc(sink, (height >> 8) & 0xff);
 
-    //fputc(0, f); // no local color table, no transparency
-    //fputc(0x80, f); // no local color table, but transparency
+    //GifPutc(sink, 0); // no local color table, no transparency
+    //GifPutc(sink, 0x80); // no local color table, but transparency
 
-    fputc(0x80 + pPal->bitDepth-1, f); // local color table present, 2 ^ bitDepth entries
-    GifWritePalette(pPal, f);
+    GifPutc(sink, 0x80 + pPal->bitDepth-1); // local color table present, 2 ^ bitDepth entries
+    GifWritePalette(pPal, sink);
 
     const int minCodeSize = pPal->bitDepth;
     const uint32_t clearCode = 1 << pPal->bitDepth;
 
-    fputc(minCodeSize, f); // min code size 8 bits
+    GifPutc(sink, minCodeSize); // min code size 8 bits
 
     GifLzwNode* codetree = (GifLzwNode*)GIF_TEMP_MALLOC(sizeof(GifLzwNode)*4096);
 
@@ -680,19 +1461,13 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
     stat.bitIndex = 0;
     stat.chunkIndex = 0;
 
-    GifWriteCode(f, &stat, clearCode, codeSize);  // start with a fresh LZW dictionary
+    GifWriteCode(sink, &stat, clearCode, codeSize);  // start with a fresh LZW dictionary
 
     for(uint32_t yy=0; yy<height; ++yy)
     {
         for(uint32_t xx=0; xx<width; ++xx)
         {
-    #ifdef GIF_FLIP_VERT
-            // bottom-left origin image (such as an OpenGL capture)
-            uint8_t nextValue = image[((height-1-yy)*width+xx)*4+3];
-    #else
-            // top-left origin
-            uint8_t nextValue = image[(yy*width+xx)*4+3];
-    #endif
+            uint8_t nextValue = indices[(ptrdiff_t)yy*rowStride + xx*pixelStride];
 
             // "worst possible mode" - no compression, every single code is followed immediately by a clear
             //WriteCode( f, stat, nextValue, codeSize );
@@ -711,7 +1486,7 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
             else
             {
                 // finish the current run, write a code
-                GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
+                GifWriteCode(sink, &stat, (uint32_t)curCode, codeSize);
 
                 // insert the new run into the dictionary
                 codetree[curCode].m_next[nextValue] = (uint16_t)++maxCode;
@@ -725,7 +1500,7 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
                 if( maxCode == 4095 )
                 {
                     // the dictionary is full, clear it out and begin anew
-                    GifWriteCode(f, &stat, clearCode, codeSize); // clear tree
+                    GifWriteCode(sink, &stat, clearCode, codeSize); // clear tree
 
                     memset(codetree, 0, sizeof(GifLzwNode)*4096);
                     codeSize = (uint32_t)(minCodeSize + 1);
@@ -738,127 +1513,493 @@ void GifWriteLzwImage(FILE* f, uint8_t* image, uint32_t left, uint32_t top,  uin
     }
 
     // compression footer
-    GifWriteCode(f, &stat, (uint32_t)curCode, codeSize);
-    GifWriteCode(f, &stat, clearCode, codeSize);
-    GifWriteCode(f, &stat, clearCode + 1, (uint32_t)minCodeSize + 1);
+    GifWriteCode(sink, &stat, (uint32_t)curCode, codeSize);
+    GifWriteCode(sink, &stat, clearCode, codeSize);
+    GifWriteCode(sink, &stat, clearCode + 1, (uint32_t)minCodeSize + 1);
 
     // write out the last partial chunk
     while( stat.bitIndex ) GifWriteBit(&stat, 0);
-    if( stat.chunkIndex ) GifWriteChunk(f, &stat);
+    if( stat.chunkIndex ) GifWriteChunk(sink, &stat);
 
-    fputc(0, f); // image block terminator
+    GifPutc(sink, 0); // image block terminator
 
     GIF_TEMP_FREE(codetree);
 }
 
+// Encoded indexed frames are remembered by the hashes of the previous and current frame:
+// the same pair of frames always produces the same bytes, so a turntable that comes back
+// to an earlier pose (e.g. a box every 90 degrees) skips the delta and LZW passes. Entries
+// keep both frames too, so a hit is confirmed by content and a hash collision is a miss.
+#ifndef GIF_FRAME_CACHE_SIZE
+#define GIF_FRAME_CACHE_SIZE 64
+#endif
+// Entries also share a memory budget per writer, so large frames get fewer of them, and
+// frames too large for a single entry are not cached at all.
+#ifndef GIF_FRAME_CACHE_BYTES
+#define GIF_FRAME_CACHE_BYTES ((size_t)32 << 20)
+#endif
+
 typedef struct
 {
-    FILE* f;
+    uint64_t lastHash;
+    uint64_t hash;
+    GifMemoryBuffer frames; // the previous frame's indices followed by the current frame's
+    GifMemoryBuffer bytes;
+} GifCachedFrame;
+
+typedef struct
+{
+    GifSink sink;
+    FILE* f;                // only set when the writer opened the file itself
     uint8_t* oldImage;
+    uint8_t* changeMask;    // one byte per pixel, nonzero where the last frame written changed
+    int numChanged;         // number of pixels that changed in the last frame written
+    GifHistogram histogram; // allocated by the first RGBA frame
+
+    // The most recent frame is held back until the next one arrives, so that identical
+    // follow-up frames can be folded into it by extending its delay.
+    GifSink frameSink;      // encodes into pendingFrame
+    GifMemoryBuffer pendingFrame;
+    uint32_t pendingDelay;
+    uint64_t lastHash;      // content hash of the last frame passed in
+    uint8_t* lastImage;     // RGBA frames: the last frame written, allocated by the first one
+
+    GifCachedFrame* frameCache; // allocated by the first indexed frame
+    int frameCacheNext;
+    size_t frameCacheBytes; // held by the entries, at most GIF_FRAME_CACHE_BYTES
+
+    // Frames changing fewer pixels than this (relative to the last frame written) are dropped
+    // and their delay added to the previous frame. 0 disables merging of near-static frames.
+    int minChangedPixels;
+
+    int framesSaved;        // frames merged into their predecessor or reused from the cache
     bool firstFrame;
 
-    uint8_t padding[7];    // make padding explicit
+    uint8_t padding[3];    // make padding explicit
 } GifWriter;
 
-// Creates a gif file.
-// The input GIFWriter is assumed to be uninitialized.
+// Starts a gif written to an arbitrary sink; see GifSink. Returns false if the frame buffers
+// cannot be allocated. The input GIFWriter is assumed to be uninitialized.
 // The delay value is the time between frames in hundredths of a second - note that not all viewers pay much attention to this value.
-bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+bool GifBeginSink( GifWriter* writer, GifWriteFn write, void* context, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
 {
     (void)bitDepth; (void)dither; // Mute "Unused argument" warnings
-#if defined(_MSC_VER) && (_MSC_VER >= 1400)
-	writer->f = 0;
-    fopen_s(&writer->f, filename, "wb");
-#else
-    writer->f = fopen(filename, "wb");
-#endif
-    if(!writer->f) return false;
+    GifSinkInit(&writer->sink, write, context);
+    writer->f = NULL;
 
     writer->firstFrame = true;
 
     // allocate
-    writer->oldImage = (uint8_t*)GIF_MALLOC(width*height*4);
-
-    fputs("GIF89a", writer->f);
+    writer->oldImage = (uint8_t*)GIF_MALLOC((size_t)width*height*4);
+    writer->changeMask = (uint8_t*)GIF_MALLOC((size_t)width*height);
+    if(!writer->oldImage || !writer->changeMask)
+    {
+        GIF_FREE(writer->oldImage);
+        GIF_FREE(writer->changeMask);
+        writer->sink.write = NULL;
+        return false;
+    }
+    writer->numChanged = (int)(width*height);
+    memset(&writer->histogram, 0, sizeof(writer->histogram));
+    memset(&writer->pendingFrame, 0, sizeof(writer->pendingFrame));
+    GifSinkInit(&writer->frameSink, GifMemoryWrite, &writer->pendingFrame);
+    writer->frameSink.counted = false;
+    writer->pendingDelay = 0;
+    writer->lastHash = 0;
+    writer->lastImage = NULL;
+    writer->frameCache = NULL;
+    writer->frameCacheNext = 0;
+    writer->frameCacheBytes = 0;
+    writer->minChangedPixels = 0;
+    writer->framesSaved = 0;
+
+    GifPuts(&writer->sink, "GIF89a");
 
     // screen descriptor
-    fputc(width & 0xff, writer->f);
-    fputc((width >> 8) & 0xff, writer->f);
-    fputc(height & 0xff, writer->f);
-    fputc((height >> 8) & 0xff, writer->f);
+    GifPutc(&writer->sink, width & 0xff);
+    GifPutc(&writer->sink, (width >> 8) & 0xff);
+    GifPutc(&writer->sink, height & 0xff);
+    GifPutc(&writer->sink, (height >> 8) & 0xff);
 
-    fputc(0xf0, writer->f);  // there is an unsorted global color table of 2 entries
-    fputc(0, writer->f);     // background color
-    fputc(0, writer->f);     // pixels are square (we need to specify this because it's 1989)
+    GifPutc(&writer->sink, 0xf0);  // there is an unsorted global color table of 2 entries
+    GifPutc(&writer->sink, 0);     // background color
+    GifPutc(&writer->sink, 0);     // pixels are square (we need to specify this because it's 1989)
 
     // now the "global" palette (really just a dummy palette)
     // color 0: black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
+    GifPutc(&writer->sink, 0);
+    GifPutc(&writer->sink, 0);
+    GifPutc(&writer->sink, 0);
     // color 1: also black
-    fputc(0, writer->f);
-    fputc(0, writer->f);
-    fputc(0, writer->f);
+    GifPutc(&writer->sink, 0);
+    GifPutc(&writer->sink, 0);
+    GifPutc(&writer->sink, 0);
 
     if( delay != 0 )
     {
         // animation header
-        fputc(0x21, writer->f); // extension
-        fputc(0xff, writer->f); // application specific
-        fputc(11, writer->f); // length 11
-        fputs("NETSCAPE2.0", writer->f); // yes, really
-        fputc(3, writer->f); // 3 bytes of NETSCAPE2.0 data
+        GifPutc(&writer->sink, 0x21); // extension
+        GifPutc(&writer->sink, 0xff); // application specific
+        GifPutc(&writer->sink, 11); // length 11
+        GifPuts(&writer->sink, "NETSCAPE2.0"); // yes, really
+        GifPutc(&writer->sink, 3); // 3 bytes of NETSCAPE2.0 data
 
-        fputc(1, writer->f); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
-        fputc(0, writer->f); // loop infinitely (byte 0)
-        fputc(0, writer->f); // loop infinitely (byte 1)
+        GifPutc(&writer->sink, 1); // this is the Netscape 2.0 sub-block ID and it must be 1, otherwise some viewers error
+        GifPutc(&writer->sink, 0); // loop infinitely (byte 0)
+        GifPutc(&writer->sink, 0); // loop infinitely (byte 1)
 
-        fputc(0, writer->f); // block terminator
+        GifPutc(&writer->sink, 0); // block terminator
     }
 
+    // a failed header write is reported by the next GifWriteFrame or GifEnd
+    GifSinkFlush(&writer->sink);
+    return true;
+}
+
+// Creates a gif file.
+// The input GIFWriter is assumed to be uninitialized.
+bool GifBegin( GifWriter* writer, const char* filename, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+{
+    FILE* f = NULL;
+#if defined(_MSC_VER) && (_MSC_VER >= 1400)
+    fopen_s(&f, filename, "wb");
+#else
+    f = fopen(filename, "wb");
+#endif
+    writer->sink.write = NULL;
+    if(!f) return false;
+
+    if(!GifBeginSink(writer, GifFileWrite, f, width, height, delay, bitDepth, dither))
+    {
+        fclose(f);
+        return false;
+    }
+    writer->f = f;
     return true;
 }
 
+// Creates a gif streamed to a file descriptor, such as 1 for stdout or the write end of a pipe.
+// The descriptor is not closed by GifEnd.
+bool GifBeginFd( GifWriter* writer, int fd, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+{
+    return GifBeginSink(writer, GifFdWrite, GifFdContext(fd), width, height, delay, bitDepth, dither);
+}
+
+// Creates a gif in a growable memory buffer, which the caller owns.
+bool GifBeginMemory( GifWriter* writer, GifMemoryBuffer* buffer, uint32_t width, uint32_t height, uint32_t delay, int32_t bitDepth = 8, bool dither = false )
+{
+    return GifBeginSink(writer, GifMemoryWrite, buffer, width, height, delay, bitDepth, dither);
+}
+
+// Sends the held-back frame to the sink, with its delay updated to include any merged frames
+bool GifFlushPendingFrame( GifWriter* writer )
+{
+    GifMemoryBuffer* pending = &writer->pendingFrame;
+    if(pending->size)
+    {
+        // the delay sits right after the graphics control extension's header and flags
+        pending->data[4] = (uint8_t)(writer->pendingDelay & 0xff);
+        pending->data[5] = (uint8_t)((writer->pendingDelay >> 8) & 0xff);
+        GifPutBytes(&writer->sink, pending->data, pending->size);
+        pending->size = 0;
+    }
+
+    // hand each finished frame to the sink so streamed output leaves as soon as it is encoded;
+    // a FILE* the caller passed in (such as stdout) is a stream, files GifBegin opened are not
+    bool ok = GifSinkFlush(&writer->sink);
+    if(ok && writer->sink.write == GifFileWrite && !writer->f)
+    {
+        GIF_SCOPE_TIMER(IO);
+        ok = fflush((FILE*)writer->sink.context) == 0;
+        writer->sink.failed = !ok;
+    }
+    return ok && !writer->frameSink.failed;
+}
+
+// Whether a frame with this content hash repeats the last one and can be folded into it
+bool GifIsRepeatedFrame( const GifWriter* writer, uint64_t hash, uint32_t delay )
+{
+    return !writer->firstFrame && hash == writer->lastHash && writer->pendingDelay + delay <= 0xffff;
+}
+
+// Whether a frame that changes numChanged pixels is too small a change to be worth writing
+bool GifIsNearStaticFrame( const GifWriter* writer, int numChanged, uint32_t delay )
+{
+    return !writer->firstFrame && numChanged < writer->minChangedPixels && writer->pendingDelay + delay <= 0xffff;
+}
+
+// Folds a repeated or near-static frame into the held-back one by extending its delay
+void GifExtendPendingFrame( GifWriter* writer, uint32_t delay )
+{
+    writer->pendingDelay += delay;
+    ++writer->framesSaved;
+}
+
 // Writes out a new frame to a GIF in progress.
 // The GIFWriter should have been created by GIFBegin.
 // AFAIK, it is legal to use different bit depths for different frames of an image -
 // this may be handy to save bits in animations that don't change much.
+// A frame identical to the previous one, or changing fewer than minChangedPixels pixels, is not
+// encoded; it extends the previous frame's delay.
+// Returns false if writing to the sink has failed.
 bool GifWriteFrame( GifWriter* writer, const uint8_t* image, uint32_t width, uint32_t height, uint32_t delay, int bitDepth = 8, bool dither = false )
 {
-    if(!writer->f) return false;
+    if(!writer->sink.write) return false;
+
+    uint64_t hash = content_hash(image, (size_t)width*height*4);
+    if(GifIsRepeatedFrame(writer, hash, delay) && memcmp(image, writer->lastImage, (size_t)width*height*4) == 0)
+    {
+        writer->numChanged = 0;
+        GifExtendPendingFrame(writer, delay);
+        return !writer->sink.failed;
+    }
 
     const uint8_t* oldImage = writer->firstFrame? NULL : writer->oldImage;
+
+    // the change mask is computed once and shared by the palette, threshold and dirty rectangle
+    const uint8_t* changeMask = NULL;
+    writer->numChanged = (int)(width*height);
+    if(oldImage && !dither)
+    {
+        writer->numChanged = GifComputeChangeMask(oldImage, image, (int)(width*height), writer->changeMask);
+        changeMask = writer->changeMask;
+
+        // barely anything moved: drop the frame, the next one is compared to the last frame written
+        if(GifIsNearStaticFrame(writer, writer->numChanged, delay))
+        {
+            GifExtendPendingFrame(writer, delay);
+            return !writer->sink.failed;
+        }
+    }
+    writer->lastHash = hash;
     writer->firstFrame = false;
+    // oldImage holds the quantized frame, so repeats are confirmed against a copy of the input
+    if(!writer->lastImage)
+        writer->lastImage = (uint8_t*)GIF_MALLOC((size_t)width*height*4);
+    memcpy(writer->lastImage, image, (size_t)width*height*4);
+
+    bool ok = GifFlushPendingFrame(writer);
+    writer->pendingDelay = delay;
+
+    if(!writer->histogram.counts)
+        GifAllocHistogram(&writer->histogram);
 
     GifPalette pal;
-    GifMakePalette((dither? NULL : oldImage), image, width, height, bitDepth, dither, &pal);
+    GifMakePalette(changeMask, image, width, height, bitDepth, dither, &writer->histogram, &pal);
 
     if(dither)
         GifDitherImage(oldImage, image, writer->oldImage, width, height, &pal);
     else
-        GifThresholdImage(oldImage, image, writer->oldImage, width, height, &pal);
+        GifThresholdImage(changeMask, image, writer->oldImage, width, height, &pal);
 
-    GifWriteLzwImage(writer->f, writer->oldImage, 0, 0, width, height, delay, &pal);
+    // only the rectangle enclosing the changed pixels needs to be encoded
+    uint32_t left = 0, top = 0, rectWidth = width, rectHeight = height;
+    if(changeMask)
+        GifChangeBounds(changeMask, width, height, &left, &top, &rectWidth, &rectHeight);
 
-    return true;
+    int32_t rowStride;
+    const uint8_t* origin = GifRectOrigin(writer->oldImage+3, 4, width, height, left, top, &rowStride);
+    GifWriteLzwImage(&writer->frameSink, origin, 4, rowStride, left, top, rectWidth, rectHeight, delay, &pal);
+    GifSinkFlush(&writer->frameSink);
+
+    return ok && !writer->frameSink.failed;
+}
+
+// Looks up the encoding of the transition from lastIndices (hashed lastHash) to indices
+// (hashed hash); numPixels indices each
+GifCachedFrame* GifFindCachedFrame( GifWriter* writer, uint64_t lastHash, uint64_t hash, const uint8_t* lastIndices, const uint8_t* indices, uint32_t numPixels )
+{
+    for(int ii=0; ii<GIF_FRAME_CACHE_SIZE; ++ii)
+    {
+        GifCachedFrame* entry = writer->frameCache + ii;
+        if(entry->bytes.size && entry->lastHash == lastHash && entry->hash == hash &&
+           memcmp(entry->frames.data, lastIndices, numPixels) == 0 && memcmp(entry->frames.data + numPixels, indices, numPixels) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+void GifEvictCachedFrame( GifWriter* writer, GifCachedFrame* entry )
+{
+    writer->frameCacheBytes -= entry->frames.capacity + entry->bytes.capacity;
+    GifFreeMemoryBuffer(&entry->frames);
+    GifFreeMemoryBuffer(&entry->bytes);
+}
+
+// Remembers the pending frame's bytes and the two frames they encode the transition between,
+// replacing the oldest cache entry, and as many more of the oldest as the budget needs
+void GifCacheFrame( GifWriter* writer, uint64_t lastHash, uint64_t hash, const uint8_t* lastIndices, const uint8_t* indices, uint32_t numPixels )
+{
+    size_t frameBytes = (size_t)numPixels * 2;
+    size_t encodedBytes = writer->pendingFrame.size;
+    if(encodedBytes == 0 || frameBytes + encodedBytes > GIF_FRAME_CACHE_BYTES)
+        return;
+
+    GifCachedFrame* entry = writer->frameCache + writer->frameCacheNext;
+    writer->frameCacheNext = (writer->frameCacheNext + 1) % GIF_FRAME_CACHE_SIZE;
+    GifEvictCachedFrame(writer, entry);
+    // the ring continues with the oldest entries
+    for(int ii=0; ii<GIF_FRAME_CACHE_SIZE && writer->frameCacheBytes + frameBytes + encodedBytes > GIF_FRAME_CACHE_BYTES; ++ii)
+        GifEvictCachedFrame(writer, writer->frameCache + (writer->frameCacheNext + ii) % GIF_FRAME_CACHE_SIZE);
+
+    entry->frames.data = (uint8_t*)GIF_MALLOC(frameBytes);
+    entry->bytes.data = (uint8_t*)GIF_MALLOC(encodedBytes);
+    entry->frames.capacity = frameBytes;
+    entry->bytes.capacity = encodedBytes;
+    writer->frameCacheBytes += frameBytes + encodedBytes;
+    if(!entry->frames.data || !entry->bytes.data)
+    {
+        GifEvictCachedFrame(writer, entry);
+        return;
+    }
+    memcpy(entry->frames.data, lastIndices, numPixels);
+    memcpy(entry->frames.data + numPixels, indices, numPixels);
+    memcpy(entry->bytes.data, writer->pendingFrame.data, encodedBytes);
+    entry->frames.size = frameBytes;
+    entry->bytes.size = encodedBytes;
+    entry->lastHash = lastHash;
+    entry->hash = hash;
+}
+
+// Writes out a new frame whose pixels are already palette indices, one byte per pixel,
+// such as a frame rendered against a palette from GifMakeRampPalette.
+// Index 0 is the transparency index and must not be used by the image.
+// Skips palette building and thresholding entirely; only the delta against the previous
+// frame is computed. Repeated and near-static frames are merged into the previous frame, and
+// recurring transitions are served from the frame cache.
+// Do not mix indexed and RGBA frames on the same GifWriter.
+bool GifWriteFrameIndexed( GifWriter* writer, const uint8_t* indices, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal )
+{
+    if(!writer->sink.write) return false;
+
+    // indexed frames need only one byte per pixel, so the RGBA-sized delta buffer holds
+    // both the previous frame's indices and the indices to encode
+    uint32_t numPixels = width*height;
+    uint8_t* lastIndices = writer->oldImage;
+    uint8_t* outIndices = writer->oldImage + numPixels;
+
+    uint64_t hash = content_hash(indices, numPixels);
+    uint64_t lastHash = writer->lastHash;
+    if(GifIsRepeatedFrame(writer, hash, delay) && memcmp(indices, lastIndices, numPixels) == 0)
+    {
+        writer->numChanged = 0;
+        GifExtendPendingFrame(writer, delay);
+        return !writer->sink.failed;
+    }
+
+    if(!writer->frameCache)
+    {
+        writer->frameCache = (GifCachedFrame*)GIF_MALLOC(sizeof(GifCachedFrame) * GIF_FRAME_CACHE_SIZE);
+        memset(writer->frameCache, 0, sizeof(GifCachedFrame) * GIF_FRAME_CACHE_SIZE);
+    }
+
+    // this transition has been encoded before: reuse its bytes
+    // (it was not near-static then, so it is not now either)
+    GifCachedFrame* cached = writer->firstFrame? NULL : GifFindCachedFrame(writer, lastHash, hash, lastIndices, indices, numPixels);
+    if(cached)
+    {
+        bool ok = GifFlushPendingFrame(writer);
+        writer->pendingDelay = delay;
+        writer->lastHash = hash;
+        GifMemoryWrite(&writer->pendingFrame, cached->bytes.data, cached->bytes.size);
+        memcpy(lastIndices, indices, numPixels);
+        ++writer->framesSaved;
+        return ok;
+    }
+
+    uint32_t left = 0, top = 0, rectWidth = width, rectHeight = height;
+    bool firstFrame = writer->firstFrame;
+    if(firstFrame)
+    {
+        memcpy(outIndices, indices, numPixels);
+        writer->numChanged = (int)numPixels;
+    }
+    else
+    {
+        // unchanged pixels become transparent and show the previous frame
+        writer->numChanged = GifDeltaIndices(lastIndices, indices, outIndices, (int)numPixels);
+
+        // barely anything moved: drop the frame, the next one is compared to the last frame written
+        if(GifIsNearStaticFrame(writer, writer->numChanged, delay))
+        {
+            GifExtendPendingFrame(writer, delay);
+            return !writer->sink.failed;
+        }
+        GifChangeBounds(outIndices, width, height, &left, &top, &rectWidth, &rectHeight);
+    }
+    writer->firstFrame = false;
+    writer->lastHash = hash;
+
+    bool ok = GifFlushPendingFrame(writer);
+    writer->pendingDelay = delay;
+
+    int32_t rowStride;
+    const uint8_t* origin = GifRectOrigin(outIndices, 1, width, height, left, top, &rowStride);
+    GifWriteLzwImage(&writer->frameSink, origin, 1, rowStride, left, top, rectWidth, rectHeight, delay, pPal);
+    GifSinkFlush(&writer->frameSink);
+
+    if(!firstFrame)
+        GifCacheFrame(writer, lastHash, hash, lastIndices, indices, numPixels);
+    memcpy(lastIndices, indices, numPixels);
+
+    return ok && !writer->frameSink.failed;
 }
 
-// Writes the EOF code, closes the file handle, and frees temp memory used by a GIF.
+// Writes out a multisampled frame of palette indices: numSamples bytes per pixel, stored
+// consecutively, as drawn by an MSAA renderer. The samples are resolved by GifResolveSamples
+// into the writer's own delta buffer, right before the delta pass, so the resolved frame
+// never exists outside the encoder. Otherwise identical to GifWriteFrameIndexed.
+bool GifWriteFrameMultisampled( GifWriter* writer, const uint8_t* samples, int numSamples, uint32_t width, uint32_t height, uint32_t delay, const GifPalette* pPal )
+{
+    if(!writer->sink.write) return false;
+    if(numSamples == 1)
+        return GifWriteFrameIndexed(writer, samples, width, height, delay, pPal);
+
+    // GifWriteFrameIndexed uses the first half of the RGBA-sized delta buffer
+    uint32_t numPixels = width*height;
+    uint8_t* resolved = writer->oldImage + numPixels*2;
+    GifResolveSamples(samples, numSamples, resolved, (int)numPixels);
+    return GifWriteFrameIndexed(writer, resolved, width, height, delay, pPal);
+}
+
+// Writes the EOF code, closes the file handle (if GifBegin opened one), and frees temp memory used by a GIF.
 // Many if not most viewers will still display a GIF properly if the EOF code is missing,
 // but it's still a good idea to write it out.
+// Returns false if any write to the sink failed.
 bool GifEnd( GifWriter* writer )
 {
-    if(!writer->f) return false;
+    if(!writer->sink.write) return false;
+
+    bool ok = GifFlushPendingFrame(writer);
+    GifPutc(&writer->sink, 0x3b); // end of file
+    ok = GifSinkFlush(&writer->sink) && ok;
+    if(writer->f)
+        ok = (fclose(writer->f) == 0) && ok;
+    else if(writer->sink.write == GifFileWrite)
+        ok = (fflush((FILE*)writer->sink.context) == 0) && ok;
 
-    fputc(0x3b, writer->f); // end of file
-    fclose(writer->f);
     GIF_FREE(writer->oldImage);
+    GIF_FREE(writer->changeMask);
+    if(writer->lastImage)
+        GIF_FREE(writer->lastImage);
+    if(writer->histogram.counts)
+        GifFreeHistogram(&writer->histogram);
+    GifFreeMemoryBuffer(&writer->pendingFrame);
+    if(writer->frameCache)
+    {
+        for(int ii=0; ii<GIF_FRAME_CACHE_SIZE; ++ii)
+            GifEvictCachedFrame(writer, writer->frameCache + ii);
+        GIF_FREE(writer->frameCache);
+        writer->frameCache = NULL;
+    }
 
+    writer->sink.write = NULL;
     writer->f = NULL;
     writer->oldImage = NULL;
+    writer->changeMask = NULL;
+    writer->lastImage = NULL;
 
-    return true;
+    return ok;
 }
 
 #endif
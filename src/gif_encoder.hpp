@@ -0,0 +1,289 @@
+#pragma once
+#include "stats.hpp"
+#define GIF_SCOPE_TIMER(stage) ScopedTimer gif_scope_timer(TIMER_##stage)
+#define GIF_COUNT(counter, n) count_stat(COUNTER_##counter, n)
+#include "gif.h"
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Encodes frames into a gif on a background thread so rendering the next frame overlaps
+// with quantizing and compressing the previous one.
+// Frames are rendered into a fixed pool of buffers: acquire_frame() blocks while every
+// buffer is queued for encoding, which bounds memory and applies backpressure to the renderer.
+// One encoder can write any number of gifs one after another (begin ... finish); its thread
+// and buffers are kept between them.
+class AsyncGifEncoder
+{
+private:
+    struct QueuedFrame
+    {
+        int buffer;
+        uint32_t delay;
+        // submission order, for the trace
+        int number;
+    };
+
+    int _width;
+    int _height;
+    GifPalette _palette;
+    bool _quantize_rgba;
+    int _samples;
+    int _min_changed_pixels = 0;
+    GifWriter _writer;
+
+    std::vector<std::vector<uint8_t>> _buffers;
+    std::vector<uint8_t> _rgba_frame;
+    std::vector<uint8_t> _resolved_frame;
+    std::vector<int> _free_buffers;
+    std::deque<QueuedFrame> _queue;
+    std::mutex _mutex;
+    std::condition_variable _frame_queued;
+    std::condition_variable _buffer_freed;
+    int _submitted = 0;
+    // between begin and finish
+    bool _writing = false;
+    bool _stopping = false;
+    bool _failed = false;
+    std::string _error;
+    std::thread _thread;
+
+    void run()
+    {
+        trace_thread_name("encoder");
+        while (true)
+        {
+            QueuedFrame frame;
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _frame_queued.wait(lock, [this] { return !_queue.empty() || _stopping; });
+                if (_queue.empty())
+                {
+                    return;
+                }
+                frame = _queue.front();
+                _queue.pop_front();
+            }
+
+            bool ok;
+            {
+                ScopedTrace trace("encode frame", frame.number);
+                ok = encode(_buffers[frame.buffer], frame.delay);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _free_buffers.push_back(frame.buffer);
+                if (!ok && !_failed)
+                {
+                    _failed = true;
+                    _error = "failed writing gif frame";
+                }
+            }
+            _buffer_freed.notify_one();
+        }
+    }
+
+    bool encode(const std::vector<uint8_t> &frame, uint32_t delay)
+    {
+        if (_failed)
+        {
+            return false;
+        }
+        if (!_quantize_rgba)
+        {
+            return GifWriteFrameMultisampled(&_writer, frame.data(), _samples, _width, _height, delay, &_palette);
+        }
+
+        // expand the palette indices to RGBA and let the encoder re-quantize them
+        const uint8_t *indices = frame.data();
+        if (_samples > 1)
+        {
+            GifResolveSamples(frame.data(), _samples, _resolved_frame.data(), _width * _height);
+            indices = _resolved_frame.data();
+        }
+        for (size_t i = 0; i < _rgba_frame.size() / 4; i++)
+        {
+            uint8_t index = indices[i];
+            _rgba_frame[i * 4] = _palette.r[index];
+            _rgba_frame[i * 4 + 1] = _palette.g[index];
+            _rgba_frame[i * 4 + 2] = _palette.b[index];
+            _rgba_frame[i * 4 + 3] = 255;
+        }
+        return GifWriteFrame(&_writer, _rgba_frame.data(), _width, _height, delay);
+    }
+
+    // called once the writer is set up for a new gif
+    void start()
+    {
+        _writer.minChangedPixels = _min_changed_pixels;
+        _submitted = 0;
+        _failed = false;
+        _error.clear();
+        _writing = true;
+        if (!_thread.joinable())
+        {
+            _thread = std::thread(&AsyncGifEncoder::run, this);
+        }
+    }
+
+public:
+    // Frame buffers hold samples palette indices per pixel, which are averaged on the encoder
+    // thread. nbuffers frames can be in flight at once: one being rendered, the rest queued
+    // or encoding.
+    AsyncGifEncoder(int width, int height, const GifPalette &palette, bool quantize_rgba, int samples = 1, int nbuffers = 3)
+        : _width(width), _height(height), _palette(palette), _quantize_rgba(quantize_rgba), _samples(samples), _writer()
+    {
+        for (int i = 0; i < nbuffers; i++)
+        {
+            _buffers.push_back(std::vector<uint8_t>((size_t)width * height * samples));
+            _free_buffers.push_back(i);
+        }
+        if (quantize_rgba)
+        {
+            _rgba_frame.resize((size_t)width * height * 4);
+            if (samples > 1)
+            {
+                _resolved_frame.resize((size_t)width * height);
+            }
+        }
+    }
+
+    ~AsyncGifEncoder()
+    {
+        finish();
+        if (_thread.joinable())
+        {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stopping = true;
+            }
+            _frame_queued.notify_one();
+            _thread.join();
+        }
+    }
+
+    // Frames changing fewer pixels than this are dropped and their delay given to the
+    // previous frame. Must be set before begin().
+    void set_min_changed_pixels(int pixels)
+    {
+        _min_changed_pixels = pixels;
+    }
+
+    // Starts writing to a file, or streaming to stdout if output is "-"
+    bool begin(const std::string &output, uint32_t delay)
+    {
+        finish();
+        bool ok = output == "-"
+                      ? GifBeginFd(&_writer, 1, _width, _height, delay)
+                      : GifBegin(&_writer, output.c_str(), _width, _height, delay);
+        if (!ok)
+        {
+            _failed = true;
+            _error = "cannot open file: " + output;
+            return false;
+        }
+        start();
+        return true;
+    }
+
+    // Starts streaming to a custom sink, such as GifMemoryWrite or a network callback.
+    // write is called from the encoder thread.
+    bool begin_sink(GifWriteFn write, void *context, uint32_t delay)
+    {
+        finish();
+        if (!GifBeginSink(&_writer, write, context, _width, _height, delay))
+        {
+            _failed = true;
+            _error = "cannot allocate gif buffers";
+            return false;
+        }
+        start();
+        return true;
+    }
+
+    // Returns the index of a free frame buffer to render into, waiting for the encoder to
+    // release one if needed, or -1 if encoding has failed.
+    int acquire_frame()
+    {
+        ScopedTimer timer(TIMER_WAIT_ENCODER);
+        std::unique_lock<std::mutex> lock(_mutex);
+        _buffer_freed.wait(lock, [this] { return !_free_buffers.empty() || _failed; });
+        if (_failed)
+        {
+            return -1;
+        }
+        int buffer = _free_buffers.back();
+        _free_buffers.pop_back();
+        return buffer;
+    }
+
+    std::vector<uint8_t> &frame(int buffer)
+    {
+        return _buffers[buffer];
+    }
+
+    // Returns an acquired frame without encoding it, e.g. when rendering it failed
+    void release_frame(int buffer)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _free_buffers.push_back(buffer);
+        }
+        _buffer_freed.notify_one();
+    }
+
+    // Queues an acquired frame for encoding. Returns false if encoding has failed.
+    bool submit_frame(int buffer, uint32_t delay)
+    {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (_failed)
+            {
+                _free_buffers.push_back(buffer);
+                return false;
+            }
+            _queue.push_back(QueuedFrame{buffer, delay, _submitted++});
+        }
+        _frame_queued.notify_one();
+        return true;
+    }
+
+    // Encodes the remaining queued frames and closes the file. Returns false if any write failed.
+    bool finish()
+    {
+        if (!_writing)
+        {
+            return !_failed;
+        }
+        {
+            // every buffer is back once the queue is empty and the last frame is encoded
+            std::unique_lock<std::mutex> lock(_mutex);
+            _buffer_freed.wait(lock, [this] { return _free_buffers.size() == _buffers.size(); });
+        }
+        _writing = false;
+
+        if (!GifEnd(&_writer) && !_failed)
+        {
+            _failed = true;
+            _error = "failed writing gif";
+        }
+        return !_failed;
+    }
+
+    // frames that were merged into their predecessor (repeated or near-static) or reused
+    // instead of being encoded
+    int frames_saved() const
+    {
+        return _writer.framesSaved;
+    }
+
+    const std::string &error() const
+    {
+        return _error;
+    }
+};
@@ -0,0 +1,141 @@
+#include <cinttypes>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "golden.hpp"
+#include "stats.hpp"
+
+bool load_golden(const std::string &filename, GoldenRecord &golden, std::string &error)
+{
+    std::ifstream in(filename);
+    if (!in)
+    {
+        error = "cannot open file: " + filename;
+        return false;
+    }
+    golden = GoldenRecord();
+    std::string line;
+    int line_number = 0;
+    while (std::getline(in, line))
+    {
+        line_number++;
+        if (line.empty() || line[0] == '#')
+        {
+            continue;
+        }
+        std::istringstream iss(line);
+        std::string kind;
+        iss >> kind;
+        bool ok = false;
+        if (kind == "frame")
+        {
+            size_t n;
+            std::string hash;
+            if (iss >> n >> hash && n == golden.frames.size())
+            {
+                golden.frames.push_back(std::strtoull(hash.c_str(), nullptr, 16));
+                ok = true;
+            }
+        }
+        else if (kind == "gif")
+        {
+            std::string hash;
+            if (iss >> hash)
+            {
+                golden.gif = std::strtoull(hash.c_str(), nullptr, 16);
+                ok = true;
+            }
+        }
+        else if (kind == "max_ms")
+        {
+            std::string stage;
+            double ms;
+            if (iss >> stage >> ms)
+            {
+                golden.max_ms.push_back(std::make_pair(stage, ms));
+                ok = true;
+            }
+        }
+        if (!ok)
+        {
+            error = filename + ":" + std::to_string(line_number) + ": invalid golden entry";
+            return false;
+        }
+    }
+    return true;
+}
+
+bool save_golden(const std::string &filename, const GoldenRecord &golden, std::string &error)
+{
+    std::ofstream out(filename);
+    char hash[32];
+    out << "# obj2gif golden checksums\n";
+    for (size_t i = 0; i < golden.frames.size(); i++)
+    {
+        snprintf(hash, sizeof(hash), "%016" PRIx64, golden.frames[i]);
+        out << "frame " << i << " " << hash << "\n";
+    }
+    snprintf(hash, sizeof(hash), "%016" PRIx64, golden.gif);
+    out << "gif " << hash << "\n";
+    for (const auto &limit : golden.max_ms)
+    {
+        out << "max_ms " << limit.first << " " << limit.second << "\n";
+    }
+    if (!out.flush())
+    {
+        error = "failed writing " + filename;
+        return false;
+    }
+    return true;
+}
+
+bool check_golden(const GoldenRecord &golden, const GoldenRecord &actual, std::string &error)
+{
+    std::string mismatches;
+    if (golden.frames.size() != actual.frames.size())
+    {
+        mismatches += "\n  " + std::to_string(actual.frames.size()) + " frames rendered, golden has " + std::to_string(golden.frames.size());
+    }
+    for (size_t i = 0; i < golden.frames.size() && i < actual.frames.size(); i++)
+    {
+        if (golden.frames[i] != actual.frames[i])
+        {
+            mismatches += "\n  frame " + std::to_string(i) + " differs";
+        }
+    }
+    if (golden.gif != actual.gif)
+    {
+        mismatches += "\n  gif bytes differ";
+    }
+
+    Stats &s = stats();
+    for (const auto &limit : golden.max_ms)
+    {
+        int timer = 0;
+        while (timer < TIMER_COUNT && limit.first != stats_timer_name(timer))
+        {
+            timer++;
+        }
+        if (timer == TIMER_COUNT)
+        {
+            mismatches += "\n  unknown stage " + limit.first;
+            continue;
+        }
+        uint64_t calls = s.calls[timer];
+        double ms = calls ? s.nanoseconds[timer] / 1e6 / calls : 0.0;
+        if (ms > limit.second)
+        {
+            char line[128];
+            snprintf(line, sizeof(line), "\n  %s took %.3f ms per call, limit %g ms", limit.first.c_str(), ms, limit.second);
+            mismatches += line;
+        }
+    }
+
+    if (!mismatches.empty())
+    {
+        error = "golden check failed:" + mismatches;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+#include "hash.hpp"
+
+// Reference checksums of a render, so changes to the rasterizer or the encoder can be checked
+// to keep the output bit-exact. Stored as text, one entry per line:
+//   frame <n> <hash>     frame n's palette indices as rendered, every MSAA sample included
+//   gif <hash>           the gif file
+//   max_ms <stage> <ms>  optional, added by hand: the mean time per call of a --stats stage
+//                        must stay below ms
+struct GoldenRecord
+{
+    std::vector<uint64_t> frames;
+    uint64_t gif = 0;
+    std::vector<std::pair<std::string, double>> max_ms;
+};
+
+bool load_golden(const std::string &filename, GoldenRecord &golden, std::string &error);
+bool save_golden(const std::string &filename, const GoldenRecord &golden, std::string &error);
+
+// Compares a render against the golden record, and the recorded stats against its time
+// limits. Returns false with every mismatch listed in error.
+bool check_golden(const GoldenRecord &golden, const GoldenRecord &actual, std::string &error);
@@ -0,0 +1,38 @@
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <vector>
+#include "hash.hpp"
+
+uint64_t content_hash(const uint8_t *data, size_t size)
+{
+    const uint64_t k = 0x9e3779b97f4a7c15ull;
+    uint64_t h = (uint64_t)size * k;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+    {
+        uint64_t v;
+        std::memcpy(&v, data + i, 8);
+        h = (h ^ (v * k)) * 0xff51afd7ed558ccdull;
+        h ^= h >> 32;
+    }
+    for (; i < size; i++)
+    {
+        h = (h ^ data[i]) * 0x100000001b3ull;
+    }
+    h ^= h >> 29;
+    return h * k;
+}
+
+bool hash_file(const std::string &filename, uint64_t &hash, std::string &error)
+{
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+    {
+        error = "cannot open file: " + filename;
+        return false;
+    }
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    hash = content_hash(bytes.data(), bytes.size());
+    return true;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 64-bit content hash, stable across runs and platforms. The one hash of the program: the gif
+// encoder recognizes repeated frames with it, golden files and result cache keys store it.
+uint64_t content_hash(const uint8_t *data, size_t size);
+bool hash_file(const std::string &filename, uint64_t &hash, std::string &error);
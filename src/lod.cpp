@@ -0,0 +1,315 @@
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <unordered_map>
+#include <vector>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lod.hpp"
+#include "reorder.hpp"
+#include "util.hpp"
+
+namespace
+{
+    const char LOD_CACHE_MAGIC[8] = {'O', '2', 'G', 'L', 'O', 'D', '0', '4'};
+    const int32_t LOD_CACHE_REORDERED = 1;
+
+    // identifies the source file a cache was built from
+    struct LodCacheKey
+    {
+        int64_t source_size;
+        int64_t source_mtime;
+        int32_t max_triangles;
+        int32_t flags;
+    };
+
+    bool source_key(const std::string &model_file, int max_triangles, bool reorder, LodCacheKey &key)
+    {
+        struct stat st;
+        if (stat(model_file.c_str(), &st) != 0)
+        {
+            return false;
+        }
+        std::memset(&key, 0, sizeof(key));
+        key.source_size = (int64_t)st.st_size;
+        key.source_mtime = (int64_t)st.st_mtime;
+        key.max_triangles = max_triangles;
+        key.flags = reorder ? LOD_CACHE_REORDERED : 0;
+        return true;
+    }
+
+    // Snaps every vertex to a cell of a grid with `resolution` cells along the longest
+    // side of the bounds and returns the cell id of each vertex.
+    void cluster_vertices(Model &model, int resolution, std::vector<uint64_t> &cells)
+    {
+        float extent = std::max(model.max_x - model.min_x, std::max(model.max_y - model.min_y, model.max_z - model.min_z));
+        float scale = extent > 0 ? resolution / extent : 0;
+        const uint64_t n = (uint64_t)resolution;
+
+        cells.resize(model.nverts());
+        for (int i = 0; i < model.nverts(); i++)
+        {
+            Vec3f v = model.vert(i);
+            uint64_t cx = (uint64_t)std::min(resolution - 1, (int)((v.x - model.min_x) * scale));
+            uint64_t cy = (uint64_t)std::min(resolution - 1, (int)((v.y - model.min_y) * scale));
+            uint64_t cz = (uint64_t)std::min(resolution - 1, (int)((v.z - model.min_z) * scale));
+            cells[i] = (cx * n + cy) * n + cz;
+        }
+    }
+
+    // triangles surviving a clustering: those whose corners land in three different cells
+    int count_clustered_triangles(const std::vector<Triangle> &triangles, const std::vector<uint64_t> &cells)
+    {
+        int count = 0;
+        for (const Triangle &t : triangles)
+        {
+            uint64_t a = cells[t[0]], b = cells[t[1]], c = cells[t[2]];
+            count += a != b && b != c && a != c;
+        }
+        return count;
+    }
+
+    void set_bounds(Model &model, const float bounds[6])
+    {
+        model.min_x = bounds[0];
+        model.min_y = bounds[1];
+        model.min_z = bounds[2];
+        model.max_x = bounds[3];
+        model.max_y = bounds[4];
+        model.max_z = bounds[5];
+    }
+
+    bool read_lod_cache(const std::string &path, const LodCacheKey &key, std::vector<Vec3f> &verts, std::vector<Triangle> &faces, std::vector<Vec3f> &normals, float bounds[6])
+    {
+        std::ifstream in(path, std::ios::binary);
+        if (!in)
+        {
+            return false;
+        }
+        char magic[8];
+        LodCacheKey cached;
+        // vertices, faces and vertex normals (0 or one per vertex)
+        uint32_t counts[3];
+        in.read(magic, sizeof(magic));
+        in.read((char *)&cached, sizeof(cached));
+        in.read((char *)bounds, 6 * sizeof(float));
+        in.read((char *)counts, sizeof(counts));
+        if (!in || std::memcmp(magic, LOD_CACHE_MAGIC, sizeof(magic)) != 0 || std::memcmp(&cached, &key, sizeof(key)) != 0 ||
+            (counts[2] != 0 && counts[2] != counts[0]))
+        {
+            return false;
+        }
+
+        verts.resize(counts[0]);
+        faces.resize(counts[1]);
+        in.read((char *)verts.data(), verts.size() * sizeof(Vec3f));
+        in.read((char *)faces.data(), faces.size() * sizeof(Triangle));
+        normals.resize(counts[2]);
+        in.read((char *)normals.data(), normals.size() * sizeof(Vec3f));
+        if (!in)
+        {
+            return false;
+        }
+        for (const Triangle &t : faces)
+        {
+            if (std::max(t[0], std::max(t[1], t[2])) >= (int)counts[0] || std::min(t[0], std::min(t[1], t[2])) < 0)
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool write_lod_cache(const std::string &path, const LodCacheKey &key, Model &model)
+    {
+        // write to a temporary name and rename so a concurrent reader never sees half a file;
+        // the name is unique to this write, as other processes or threads may be writing too
+        static std::atomic<int> writes(0);
+        std::string temp_path = path + ".tmp" + std::to_string(getpid()) + "." + std::to_string(writes++);
+        bool ok;
+        {
+            std::ofstream out(temp_path, std::ios::binary | std::ios::trunc);
+            if (!out)
+            {
+                return false;
+            }
+            float bounds[6] = {model.min_x, model.min_y, model.min_z, model.max_x, model.max_y, model.max_z};
+            uint32_t counts[3] = {(uint32_t)model.nverts(), (uint32_t)model.nfaces(), model.has_normals() ? (uint32_t)model.nverts() : 0};
+            out.write(LOD_CACHE_MAGIC, sizeof(LOD_CACHE_MAGIC));
+            out.write((const char *)&key, sizeof(key));
+            out.write((const char *)bounds, sizeof(bounds));
+            out.write((const char *)counts, sizeof(counts));
+            for (int i = 0; i < model.nverts(); i++)
+            {
+                Vec3f v = model.vert(i);
+                out.write((const char *)&v, sizeof(v));
+            }
+            for (int i = 0; i < model.nfaces(); i++)
+            {
+                Triangle face = model.face(i);
+                out.write((const char *)face.data(), sizeof(face));
+            }
+            for (int i = 0; model.has_normals() && i < model.nverts(); i++)
+            {
+                Vec3f n = model.normal(i);
+                out.write((const char *)&n, sizeof(n));
+            }
+            out.close();
+            ok = !out.fail();
+        }
+        if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0)
+        {
+            std::remove(temp_path.c_str());
+            return false;
+        }
+        return true;
+    }
+}
+
+int lod_triangle_budget(int width, int height)
+{
+    // 64 bit, since sizes up to 65535 x 65535 overflow an int
+    return (int)std::min<int64_t>(INT_MAX, std::max<int64_t>(64, (int64_t)width * height / 2));
+}
+
+Model simplify_model(Model &model, int max_triangles)
+{
+    std::vector<Triangle> triangles;
+    triangles.reserve(model.nfaces());
+    for (int i = 0; i < model.nfaces(); i++)
+    {
+        triangles.push_back(model.face(i));
+    }
+
+    // the finest grid within budget; the surviving triangle count grows with the resolution
+    std::vector<uint64_t> cells;
+    int lo = 1;
+    int hi = 4096;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        cluster_vertices(model, mid, cells);
+        if (count_clustered_triangles(triangles, cells) <= max_triangles)
+        {
+            lo = mid;
+        }
+        else
+        {
+            hi = mid - 1;
+        }
+    }
+    cluster_vertices(model, lo, cells);
+
+    // one vertex per occupied cell, at the mean of the vertices that fell into it
+    std::unordered_map<uint64_t, int> cluster_of_cell;
+    std::vector<int> cluster(model.nverts());
+    std::vector<Vec3f> sums;
+    std::vector<Vec3f> normal_sums;
+    std::vector<int> counts;
+    for (int i = 0; i < model.nverts(); i++)
+    {
+        auto inserted = cluster_of_cell.emplace(cells[i], (int)sums.size());
+        if (inserted.second)
+        {
+            sums.push_back(Vec3f());
+            normal_sums.push_back(Vec3f());
+            counts.push_back(0);
+        }
+        cluster[i] = inserted.first->second;
+        sums[cluster[i]] = sums[cluster[i]] + model.vert(i);
+        if (model.has_normals())
+        {
+            normal_sums[cluster[i]] = normal_sums[cluster[i]] + model.normal(i);
+        }
+        counts[cluster[i]]++;
+    }
+    std::vector<Vec3f> verts(sums.size());
+    for (size_t i = 0; i < sums.size(); i++)
+    {
+        verts[i] = sums[i] * (1.0f / counts[i]);
+    }
+
+    // drop collapsed triangles and duplicates, rotating each so its smallest index comes
+    // first to keep the winding while making duplicates compare equal
+    std::vector<Triangle> kept;
+    for (const Triangle &t : triangles)
+    {
+        int a = cluster[t[0]], b = cluster[t[1]], c = cluster[t[2]];
+        if (a == b || b == c || a == c)
+        {
+            continue;
+        }
+        if (b < a && b < c)
+        {
+            kept.push_back({b, c, a});
+        }
+        else if (c < a && c < b)
+        {
+            kept.push_back({c, a, b});
+        }
+        else
+        {
+            kept.push_back({a, b, c});
+        }
+    }
+    std::sort(kept.begin(), kept.end());
+    kept.erase(std::unique(kept.begin(), kept.end()), kept.end());
+
+    Model lod(std::move(verts), std::move(kept));
+    lod.copy_bounds(model);
+    if (model.has_normals())
+    {
+        // the merged vertex's normal sums those of the vertices it replaces
+        lod.set_normals(std::move(normal_sums));
+    }
+    return lod;
+}
+
+Model load_model_lod(const std::string &model_file, int max_triangles, bool reorder, bool use_cache)
+{
+    LodCacheKey key;
+    std::string cache_path = model_file + ".lod" + std::to_string(std::max(0, max_triangles)) + (reorder ? "r" : "");
+    bool cacheable = use_cache && (max_triangles > 0 || reorder) && source_key(model_file, max_triangles, reorder, key);
+    if (cacheable)
+    {
+        std::vector<Vec3f> verts;
+        std::vector<Triangle> faces;
+        std::vector<Vec3f> normals;
+        float bounds[6];
+        if (read_lod_cache(cache_path, key, verts, faces, normals, bounds))
+        {
+            Model lod(std::move(verts), std::move(faces));
+            set_bounds(lod, bounds);
+            lod.set_normals(std::move(normals));
+            Log("Model loaded from lod cache: " + std::to_string(lod.nverts()) + " vertices, " + std::to_string(lod.nfaces()) + " faces.");
+            return lod;
+        }
+    }
+
+    Model model(model_file);
+    bool simplify = max_triangles > 0 && model.nfaces() > max_triangles;
+    if (!simplify && !reorder)
+    {
+        return model;
+    }
+
+    Model lod = simplify ? simplify_model(model, max_triangles) : std::move(model);
+    if (simplify)
+    {
+        Log("Model simplified to " + std::to_string(lod.nfaces()) + " faces for a budget of " + std::to_string(max_triangles) + ".");
+    }
+    if (reorder)
+    {
+        lod = reorder_model(lod);
+    }
+    if (cacheable && !write_lod_cache(cache_path, key, lod))
+    {
+        Log("Cannot write lod cache: " + cache_path);
+    }
+    return lod;
+}
@@ -0,0 +1,20 @@
+#pragma once
+#include <string>
+#include "model.hpp"
+
+// Triangle budget for rendering at width x height. The model covers about a quarter of
+// the frame and half its triangles face away, so this leaves roughly one visible
+// triangle per covered pixel; more detail than that only adds sub-pixel triangles.
+int lod_triangle_budget(int width, int height);
+
+// Decimates the model by vertex clustering: vertices are snapped to a uniform grid, each
+// occupied cell is replaced by the mean of its vertices and triangles collapsing within a
+// cell are dropped. The grid is the finest one that keeps the mesh within max_triangles.
+// The result keeps the source bounds, so it maps onto the screen exactly like the source.
+Model simplify_model(Model &model, int max_triangles);
+
+// Loads model_file reduced to at most max_triangles (max_triangles <= 0 keeps every
+// triangle), optionally reordered for locality with reorder_model. With use_cache the
+// prepared mesh is stored next to the model as <model_file>.lod<max_triangles>[r] and
+// reused while the source file is unchanged, which skips parsing the obj entirely.
+Model load_model_lod(const std::string &model_file, int max_triangles, bool reorder, bool use_cache);
@@ -1,68 +1,241 @@
-#include "model.hpp"
-#include "drawing.hpp"
-#include "constants.hpp"
-#include <limits>
+#include "obj2gif.hpp"
+#include "lod.hpp"
+#include "reorder.hpp"
+#include "render_spec.hpp"
+#include "stats.hpp"
+#include "golden.hpp"
+#include "result_cache.hpp"
+#include "server.hpp"
+#include "util.hpp"
 #include <vector>
-#include "gif.h"
 #include <string>
-#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
 
-void flip_frame_vertical(std::vector<uint8_t> &frame, int width, int height)
+// Renders spec.frames frames of a randomly shuffled copy of the model and of the same mesh
+// after reorder_model, without encoding, and logs the mean render time of each. Returns
+// false with error set if the renderer cannot be configured.
+bool benchmark_reorder(const RenderSpec &spec, std::string &error)
 {
-    const int row_size = width * 4;
-    const int half_height = height / 2;
+    Model source = load_model_lod(spec.model_file, spec.triangle_budget(), false, false);
+    Model shuffled = shuffle_model(source, 1);
+    Model reordered = reorder_model(shuffled);
 
-    for (int y = 0; y < half_height; y++)
+    Renderer renderer;
+    if (!renderer.configure(spec, error))
     {
-        int top_row_start = y * row_size;
-        int bottom_row_start = (height - 1 - y) * row_size;
+        return false;
+    }
+    std::vector<uint8_t> image;
+    for (Model *model : {&shuffled, &reordered})
+    {
+        std::shared_ptr<const PreparedModel> prepared = PreparedModel::from_model(*model);
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < spec.frames; i++)
+        {
+            renderer.render_frame(*prepared, i, image);
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+        Log(std::string(model == &shuffled ? "shuffled:  " : "reordered: ") + std::to_string(elapsed.count() / spec.frames) + " ms/frame");
+    }
+    return true;
+}
 
-        std::swap_ranges(
-            frame.begin() + top_row_start,
-            frame.begin() + top_row_start + row_size,
-            frame.begin() + bottom_row_start);
+// writes a gif held in memory to a file, or to stdout for "-"
+bool write_gif(const std::string &filename, const std::vector<uint8_t> &gif, std::string &error)
+{
+    FILE *f = filename == "-" ? stdout : fopen(filename.c_str(), "wb");
+    bool ok = f && fwrite(gif.data(), 1, gif.size(), f) == gif.size();
+    ok = f && (f == stdout ? fflush(f) : fclose(f)) == 0 && ok;
+    if (!ok)
+    {
+        error = "cannot write " + filename;
     }
+    return ok;
 }
 
 int main(int argc, char *argv[])
 {
-    std::vector<float> z_buffer(WIDTH * HEIGHT, -std::numeric_limits<float>::max());
-    std::vector<uint8_t>
-        frame(WIDTH * HEIGHT * 4);
-
-    std::string model_file;
+    RenderSpec spec;
+    std::string error;
 
 #if _DEBUG
-    model_file = "test.obj";
+    spec.model_file = "test.obj";
 #else
-    if (argc != 2) {
-        Log("usage: obj2gif <model.obj>");
-        return 0;
+    if (!parse_render_args(argc, argv, spec, error))
+    {
+        Log("Error: " + error);
+        Log(RENDER_USAGE);
+        return 1;
     }
-    else {
-        model_file = argv[1];
+    if (spec.model_file.empty() && spec.serve_socket.empty())
+    {
+        Log(RENDER_USAGE);
+        return 0;
     }
 #endif
-    Model model(model_file);
-
-    const int nframes = 200;
-    const int delay = std::max(2, 500 / nframes);
-    GifWriter g;
-    std::string gif_filename = model_file + ".gif";
-    GifBegin(&g, gif_filename.c_str(), WIDTH, HEIGHT, delay);
+    if (!spec.validate(error))
+    {
+        Log("Error: " + error);
+        return 1;
+    }
+    // the encoder kernels are process wide; the renderer resolves the spec's kernel the same way
+    Renderer renderer;
+    if (!renderer.configure(spec, error))
+    {
+        Log("Error: " + error);
+        return 1;
+    }
+    set_encoder_kernel(renderer.spec().kernel);
+    Log(std::string("Kernels: ") + kernel_name(renderer.spec().kernel));
 
-    for (int i = 0; i < nframes; i++)
+    // an existing golden file is checked, a missing one is recorded by this run
+    GoldenRecord golden;
+    GoldenRecord rendered;
+    bool record_golden = !spec.golden_file.empty() && !std::ifstream(spec.golden_file).good();
+    if (!spec.golden_file.empty() && !record_golden && !load_golden(spec.golden_file, golden, error))
+    {
+        Log("Error: " + error);
+        return 1;
+    }
+    if (spec.stats != STATS_OFF || !golden.max_ms.empty())
+    {
+        stats_enable();
+    }
+    if (!spec.trace_file.empty())
+    {
+        trace_enable();
+        trace_thread_name("render");
+    }
+    if (!spec.serve_socket.empty())
     {
-        draw_model(model, 2 * 3.1415f / nframes * i, Color{0, 255, 255, 255}, frame, z_buffer);
-        flip_frame_vertical(frame, WIDTH, HEIGHT);
+        if (!run_server(renderer.spec(), spec.serve_socket, error))
+        {
+            Log("Error: " + error);
+            return 1;
+        }
+        return 0;
+    }
+    if (spec.benchmark_reorder)
+    {
+        if (!benchmark_reorder(renderer.spec(), error))
+        {
+            Log("Error: " + error);
+            return 1;
+        }
+        return 0;
+    }
+    // "-" streams the gif to stdout as frames are encoded, unless it goes through the result cache
+    std::string gif_filename = spec.output.empty() ? spec.model_file + ".gif" : spec.output;
+    // golden runs need every frame rendered, so they skip the result cache
+    bool use_results = !spec.result_cache_dir.empty() && spec.golden_file.empty();
+    ResultCache results(spec.result_cache_dir, (uint64_t)spec.result_cache_mb << 20);
+    std::string result_key;
+    std::vector<uint8_t> gif;
+    if (use_results)
+    {
+        if (!results.key(spec, result_key, error))
+        {
+            Log("Error: " + error);
+            return 1;
+        }
+        if (results.load(result_key, spec.frame_delay(), gif))
+        {
+            if (!write_gif(gif_filename, gif, error))
+            {
+                Log("Error: " + error);
+                return 1;
+            }
+            Log("Gif loaded from result cache: " + result_key);
+            if (gif_filename != "-")
+            {
+                Log("Gif saved as: " + gif_filename);
+            }
+            return 0;
+        }
+    }
 
-        GifWriteFrame(&g, frame.data(), WIDTH, HEIGHT, delay);
+    std::shared_ptr<const PreparedModel> model = PreparedModel::load(spec, error);
+    if (!model)
+    {
+        Log("Error: " + error);
+        return 1;
+    }
+    Log(std::string("Depth buffer: ") + (renderer.depth_format(*model) == DEPTH_UNORM16 ? "16 bit unorm" : "32 bit float"));
 
-        std::fill(frame.begin(), frame.end(), 0);
-        std::fill(z_buffer.begin(), z_buffer.end(), 0);
+    const int nframes = spec.frames;
+    auto on_frame = [&](int i, const std::vector<uint8_t> &frame)
+    {
+        if (!spec.golden_file.empty())
+        {
+            rendered.frames.push_back(content_hash(frame.data(), frame.size()));
+        }
         Log("Frame: " + std::to_string(i + 1) + "/" + std::to_string(nframes));
+    };
+    bool rendered_ok = use_results
+                           ? renderer.render_gif(*model, [&gif](const uint8_t *data, size_t size) { gif.insert(gif.end(), data, data + size); return true; }, error, on_frame) &&
+                                 write_gif(gif_filename, gif, error)
+                           : renderer.render_gif(*model, gif_filename, error, on_frame);
+    if (!rendered_ok)
+    {
+        Log("Error: " + error);
+        return 1;
+    }
+    if (use_results)
+    {
+        if (results.store(result_key, spec.frame_delay(), gif, error))
+        {
+            Log("Gif stored in result cache: " + result_key);
+        }
+        else
+        {
+            Log("Gif not stored in result cache: " + error);
+        }
+    }
+    Log("Frames saved: " + std::to_string(renderer.frames_saved()) + "/" + std::to_string(nframes));
+    if (spec.stats != STATS_OFF)
+    {
+        Log(stats_report(spec.stats == STATS_JSON));
+    }
+    if (!spec.trace_file.empty())
+    {
+        if (!trace_write(spec.trace_file, error))
+        {
+            Log("Error: " + error);
+            return 1;
+        }
+        Log("Trace saved as: " + spec.trace_file);
+    }
+    if (gif_filename != "-")
+    {
+        Log("Gif saved as: " + gif_filename);
     }
 
-    GifEnd(&g);
-    Log("Gif saved as: " + gif_filename);
+    if (!spec.golden_file.empty())
+    {
+        if (!hash_file(gif_filename, rendered.gif, error))
+        {
+            Log("Error: " + error);
+            return 1;
+        }
+        if (record_golden)
+        {
+            if (!save_golden(spec.golden_file, rendered, error))
+            {
+                Log("Error: " + error);
+                return 1;
+            }
+            Log("Golden saved as: " + spec.golden_file);
+        }
+        else if (!check_golden(golden, rendered, error))
+        {
+            Log("Error: " + error);
+            return 1;
+        }
+        else
+        {
+            Log("Golden check passed: " + spec.golden_file);
+        }
+    }
 }
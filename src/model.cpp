@@ -5,9 +5,20 @@
 #include <vector>
 #include "model.hpp"
 #include "util.hpp"
+#include "stats.hpp"
 
-Model::Model(std::string filename) : _verts(), _faces()
+namespace
 {
+    // obj indices count from 1, negative ones back from the last element read so far
+    int resolve_index(int index, size_t count)
+    {
+        return index < 0 ? (int)count + index : index - 1;
+    }
+}
+
+Model::Model(std::string filename) : _verts(), _faces(), _normals()
+{
+    ScopedTimer timer(TIMER_PARSE);
     std::ifstream in(filename);
     if (!in)
     {
@@ -16,6 +27,9 @@ Model::Model(std::string filename) : _verts(), _faces()
     }
 
     std::string line;
+    // vn records, and the one each face corner refers to
+    std::vector<Vec3f> file_normals;
+    std::vector<std::pair<int, int>> corner_normals;
 
     while (std::getline(in, line))
     {
@@ -42,6 +56,12 @@ Model::Model(std::string filename) : _verts(), _faces()
             max_y = std::max(v.y, max_y);
             max_z = std::max(v.z, max_z);
         }
+        else if (prefix == "vn")
+        {
+            Vec3f n;
+            iss >> n.x >> n.y >> n.z;
+            file_normals.push_back(n.norm() > 0 ? n.normalize() : n);
+        }
         else if (prefix == "f")
         {
             std::vector<int> face_indices;
@@ -50,33 +70,80 @@ Model::Model(std::string filename) : _verts(), _faces()
             while (iss >> face_vertex_str)
             {
                 size_t slash_pos = face_vertex_str.find('/');
-                int idx = std::stoi(face_vertex_str.substr(0, slash_pos));
-
-                face_indices.push_back(idx - 1);
+                int idx = resolve_index(std::stoi(face_vertex_str.substr(0, slash_pos)), _verts.size());
+
+                face_indices.push_back(idx);
+                // v/vt/vn or v//vn
+                size_t normal_pos = slash_pos == std::string::npos ? std::string::npos : face_vertex_str.find('/', slash_pos + 1);
+                if (normal_pos != std::string::npos && normal_pos + 1 < face_vertex_str.size())
+                {
+                    corner_normals.push_back(std::make_pair(idx, resolve_index(std::stoi(face_vertex_str.substr(normal_pos + 1)), file_normals.size())));
+                }
             }
-            // triangulation
-            if (face_indices.size() == 4) {
-                int a = face_indices[0];
-                int b = face_indices[1];
-                int c = face_indices[2];
-                int d = face_indices[3];
-                face_indices.pop_back();
-                _faces.push_back({c, d, a});
+            // fan triangulation, exact for the convex polygons exporters write
+            for (size_t i = 2; i < face_indices.size(); i++)
+            {
+                _faces.push_back(Triangle{face_indices[0], face_indices[i - 1], face_indices[i]});
             }
-            _faces.push_back(face_indices);
-
         }
     }
 
+    for (const Triangle &face : _faces)
+    {
+        for (int v : face)
+        {
+            if (v < 0 || v >= (int)_verts.size())
+            {
+                Log("Vertex index out of range in file: " + filename);
+                throw std::runtime_error("Vertex index out of range in file: " + filename);
+            }
+        }
+    }
 
+    if (!corner_normals.empty())
+    {
+        // vertices are shared between faces, so corners giving one vertex different normals
+        // (hard edges) are averaged
+        _normals.resize(_verts.size());
+        for (const std::pair<int, int> &corner : corner_normals)
+        {
+            if (corner.first >= 0 && corner.first < (int)_verts.size() && corner.second >= 0 && corner.second < (int)file_normals.size())
+            {
+                _normals[corner.first] = _normals[corner.first] + file_normals[corner.second];
+            }
+        }
+    }
 
     std::cerr << "Model loaded: " << _verts.size() << " vertices, " << _faces.size() << " faces." << std::endl;
 }
 
+Model::Model(std::vector<Vec3f> verts, std::vector<Triangle> faces) : _verts(std::move(verts)), _faces(std::move(faces))
+{
+    for (const Vec3f &v : _verts)
+    {
+        min_x = std::min(v.x, min_x);
+        min_y = std::min(v.y, min_y);
+        min_z = std::min(v.z, min_z);
+        max_x = std::max(v.x, max_x);
+        max_y = std::max(v.y, max_y);
+        max_z = std::max(v.z, max_z);
+    }
+}
+
 Model::~Model()
 {
 }
 
+void Model::copy_bounds(const Model &other)
+{
+    min_x = other.min_x;
+    min_y = other.min_y;
+    min_z = other.min_z;
+    max_x = other.max_x;
+    max_y = other.max_y;
+    max_z = other.max_z;
+}
+
 int Model::nverts()
 {
     return (int)_verts.size();
@@ -87,7 +154,7 @@ int Model::nfaces()
     return (int)_faces.size();
 }
 
-std::vector<int> Model::face(int idx)
+Triangle Model::face(int idx)
 {
     return _faces[idx];
 }
@@ -95,4 +162,19 @@ std::vector<int> Model::face(int idx)
 Vec3f Model::vert(int i)
 {
     return _verts[i];
+}
+
+bool Model::has_normals()
+{
+    return !_normals.empty();
+}
+
+Vec3f Model::normal(int i)
+{
+    return _normals[i];
+}
+
+void Model::set_normals(std::vector<Vec3f> normals)
+{
+    _normals = std::move(normals);
 }
\ No newline at end of file
@@ -1,22 +1,42 @@
 #pragma once
 
 
+#include <array>
 #include <vector>
 #include "geometry.hpp"
 
+// vertex indices of a triangle, counter-clockwise when front facing
+typedef std::array<int, 3> Triangle;
+
 class Model
 {
 private:
     std::vector<Vec3f> _verts;
-    std::vector<std::vector<int>> _faces;
+    // polygons are fan triangulated while loading, so every face is a triangle
+    std::vector<Triangle> _faces;
+    // one per vertex if the file has vn normals, otherwise empty
+    std::vector<Vec3f> _normals;
 
 public:
     Model(std::string filename);
+    // builds a model from an existing mesh, such as a decimated level of detail
+    Model(std::vector<Vec3f> verts, std::vector<Triangle> faces);
+    Model(const Model &) = default;
+    Model(Model &&) = default;
+    Model &operator=(const Model &) = default;
+    Model &operator=(Model &&) = default;
     ~Model();
     int nverts();
     int nfaces();
     Vec3f vert(int i);
-    std::vector<int> face(int idx);
+    Triangle face(int idx);
+    // Vertex normals of the source file: the sum of the vn normals its faces give each vertex,
+    // zero for vertices no face gives one. Derived meshes carry them over with set_normals.
+    bool has_normals();
+    Vec3f normal(int i);
+    void set_normals(std::vector<Vec3f> normals);
+    // takes over another model's bounds, so a derived mesh maps onto the screen like its source
+    void copy_bounds(const Model &other);
     float min_x = std::numeric_limits<float>::max();
     float min_y = std::numeric_limits<float>::max();
     float min_z = std::numeric_limits<float>::max();
@@ -0,0 +1,86 @@
+#include <sys/stat.h>
+#include "model_cache.hpp"
+
+std::shared_ptr<const PreparedModel> ModelCache::get(const RenderSpec &spec, std::string &error, bool *hit)
+{
+    struct stat st;
+    if (stat(spec.model_file.c_str(), &st) != 0)
+    {
+        error = "cannot open file: " + spec.model_file;
+        return nullptr;
+    }
+    std::string key = spec.model_file + '\n' + std::to_string(spec.triangle_budget()) + (spec.reorder ? "r" : "");
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        auto found = _index.find(key);
+        if (found != _index.end())
+        {
+            std::list<Entry>::iterator entry = found->second;
+            if (entry->source_mtime == (int64_t)st.st_mtime && entry->source_size == (int64_t)st.st_size)
+            {
+                _entries.splice(_entries.begin(), _entries, entry);
+                _hits++;
+                if (hit)
+                {
+                    *hit = true;
+                }
+                return entry->model;
+            }
+            // the file changed since it was loaded
+            erase(entry);
+        }
+        _misses++;
+    }
+    if (hit)
+    {
+        *hit = false;
+    }
+
+    std::shared_ptr<const PreparedModel> model = PreparedModel::load(spec, error);
+    if (!model)
+    {
+        return nullptr;
+    }
+    size_t bytes = model->memory_bytes();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _index.find(key);
+    if (found != _index.end())
+    {
+        // another thread loaded it meanwhile; keep the newer copy
+        erase(found->second);
+    }
+    if (bytes > _capacity)
+    {
+        return model;
+    }
+    while (_bytes + bytes > _capacity)
+    {
+        erase(std::prev(_entries.end()));
+        _evictions++;
+    }
+    _entries.push_front(Entry{key, (int64_t)st.st_mtime, (int64_t)st.st_size, model, bytes});
+    _index[key] = _entries.begin();
+    _bytes += bytes;
+    return model;
+}
+
+ModelCache::Metrics ModelCache::metrics() const
+{
+    std::lock_guard<std::mutex> lock(_mutex);
+    Metrics m;
+    m.hits = _hits;
+    m.misses = _misses;
+    m.evictions = _evictions;
+    m.entries = _entries.size();
+    m.bytes = _bytes;
+    m.capacity_bytes = _capacity;
+    return m;
+}
+
+void ModelCache::erase(std::list<Entry>::iterator entry)
+{
+    _bytes -= entry->bytes;
+    _index.erase(entry->key);
+    _entries.erase(entry);
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "obj2gif.hpp"
+#include "render_spec.hpp"
+
+// Prepared models kept in memory between renders, keyed by model file, triangle budget and
+// reordering. Entries are dropped least recently used first once their estimated size
+// (PreparedModel::memory_bytes) exceeds the budget, and reloaded when the model file's
+// modification time or size changes. Safe to share between threads; loads run outside the
+// lock, so a slow parse does not hold up hits on other models.
+class ModelCache
+{
+public:
+    struct Metrics
+    {
+        uint64_t hits = 0;
+        uint64_t misses = 0;
+        uint64_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+        size_t capacity_bytes = 0;
+    };
+
+    explicit ModelCache(size_t capacity_bytes) : _capacity(capacity_bytes) {}
+
+    // The prepared model for spec, from the cache or loaded into it. Returns null and sets
+    // error if the model cannot be loaded. hit, if given, tells whether the cache had it.
+    std::shared_ptr<const PreparedModel> get(const RenderSpec &spec, std::string &error, bool *hit = nullptr);
+
+    Metrics metrics() const;
+
+private:
+    struct Entry
+    {
+        std::string key;
+        int64_t source_mtime;
+        int64_t source_size;
+        std::shared_ptr<const PreparedModel> model;
+        size_t bytes;
+    };
+
+    size_t _capacity;
+    size_t _bytes = 0;
+    // most recently used first
+    std::list<Entry> _entries;
+    std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+    uint64_t _hits = 0;
+    uint64_t _misses = 0;
+    uint64_t _evictions = 0;
+    mutable std::mutex _mutex;
+
+    void erase(std::list<Entry>::iterator entry);
+};
@@ -0,0 +1,68 @@
+#include "normals.hpp"
+
+MeshNormals build_normals(Model &model)
+{
+    MeshNormals normals;
+    normals.faces.resize(model.nfaces());
+    // the cross products are twice each face's area, so summing them weights by area
+    std::vector<Vec3f> area_sums(model.nverts());
+    for (int i = 0; i < model.nfaces(); i++)
+    {
+        Triangle face = model.face(i);
+        Vec3f a = model.vert(face[0]);
+        Vec3f b = model.vert(face[1]);
+        Vec3f c = model.vert(face[2]);
+        Vec3f n = (b - a).cross(c - a);
+        for (int v : face)
+        {
+            area_sums[v] = area_sums[v] + n;
+        }
+        normals.faces[i] = n.norm() > 0 ? n.normalize() : Vec3f();
+    }
+
+    normals.vertices.resize(model.nverts());
+    bool from_file = model.has_normals();
+    for (int i = 0; i < model.nverts(); i++)
+    {
+        Vec3f n = from_file && model.normal(i).norm() > 0 ? model.normal(i) : area_sums[i];
+        normals.vertices[i] = n.norm() > 0 ? n.normalize() : Vec3f();
+    }
+    return normals;
+}
+
+namespace
+{
+    void add_coefficients(Vec3f n, Vec3f k, Vec3f l, Vec3f l_cross_k, std::vector<float> &a, std::vector<float> &b, std::vector<float> &c)
+    {
+        float along_axis = n.dot(k) * k.dot(l);
+        a.push_back(n.dot(l) - along_axis);
+        b.push_back(n.dot(l_cross_k));
+        c.push_back(along_axis);
+    }
+}
+
+TurntableLighting build_turntable_lighting(const MeshNormals &normals, const std::vector<int> &triangles, Vec3f axis, Vec3f light)
+{
+    TurntableLighting lighting;
+    lighting.axis = axis;
+    lighting.light = light;
+    Vec3f k = axis.normalize();
+    Vec3f l = light.normalize();
+    Vec3f l_cross_k = l.cross(k);
+
+    lighting.face_a.reserve(triangles.size());
+    lighting.face_b.reserve(triangles.size());
+    lighting.face_c.reserve(triangles.size());
+    for (int f : triangles)
+    {
+        add_coefficients(normals.faces[f], k, l, l_cross_k, lighting.face_a, lighting.face_b, lighting.face_c);
+    }
+    lighting.vertex_a.reserve(normals.vertices.size());
+    lighting.vertex_b.reserve(normals.vertices.size());
+    lighting.vertex_c.reserve(normals.vertices.size());
+    for (const Vec3f &n : normals.vertices)
+    {
+        add_coefficients(n, k, l, l_cross_k, lighting.vertex_a, lighting.vertex_b, lighting.vertex_c);
+    }
+    return lighting;
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <vector>
+#include "geometry.hpp"
+#include "model.hpp"
+
+// Shading normals of a mesh in model space, computed once when it is prepared. Frames turn
+// the light into model space instead, so shading a face is a single dot product.
+struct MeshNormals
+{
+    // unit normal of each face, zero for degenerate faces
+    std::vector<Vec3f> faces;
+    // unit normal of each vertex: the file's vn normals where it has them, otherwise the
+    // mean of the adjacent faces' normals weighted by their area
+    std::vector<Vec3f> vertices;
+};
+
+MeshNormals build_normals(Model &model);
+
+// Light received on a turntable. Turned by theta around the unit axis k, a surface with normal
+// n faces a fixed unit light direction l by
+//   dot(R(theta) n, l) = a cos(theta) + b sin(theta) + c
+//   with c = (n.k)(k.l), a = n.l - c, b = n.(l x k)
+// so once a, b and c are known, shading a frame takes two multiply-adds per face or vertex.
+struct TurntableLighting
+{
+    // what the table was built for, as given (not normalized)
+    Vec3f axis;
+    Vec3f light;
+    // per entry of MeshClusters::triangles, so a cluster's faces are contiguous
+    std::vector<float> face_a, face_b, face_c;
+    // per vertex, for Gouraud shading
+    std::vector<float> vertex_a, vertex_b, vertex_c;
+
+    float face_light(size_t t, float cos_angle, float sin_angle) const
+    {
+        return face_a[t] * cos_angle + face_b[t] * sin_angle + face_c[t];
+    }
+
+    float vertex_light(size_t i, float cos_angle, float sin_angle) const
+    {
+        return vertex_a[i] * cos_angle + vertex_b[i] * sin_angle + vertex_c[i];
+    }
+};
+
+// triangles lists face indices in the order the face table should follow
+TurntableLighting build_turntable_lighting(const MeshNormals &normals, const std::vector<int> &triangles, Vec3f axis, Vec3f light);
@@ -0,0 +1,295 @@
+// The one translation unit of the library that includes drawing.hpp and gif.h: both define
+// their functions in the header, so including them anywhere else would define them twice.
+#include "obj2gif.hpp"
+#include "clusters.hpp"
+#include "drawing.hpp"
+#include "gif_encoder.hpp"
+#include "lod.hpp"
+#include <algorithm>
+#include <exception>
+#include <mutex>
+
+struct PreparedModel::Data
+{
+    // Model's accessors are not const qualified, but rendering only reads the mesh
+    mutable Model model;
+    MeshNormals normals;
+    MeshClusters clusters;
+    // lighting table of the axis and light direction rendered last; a frame keeps the table
+    // it started with while a render with another light replaces it
+    std::mutex lighting_mutex;
+    std::shared_ptr<const TurntableLighting> lighting;
+
+    explicit Data(Model source) : model(std::move(source)) {}
+    std::shared_ptr<const TurntableLighting> turntable_lighting(Vec3f axis, Vec3f light);
+};
+
+std::shared_ptr<const TurntableLighting> PreparedModel::Data::turntable_lighting(Vec3f axis, Vec3f light)
+{
+    auto same = [](Vec3f a, Vec3f b) { return a.x == b.x && a.y == b.y && a.z == b.z; };
+    {
+        std::lock_guard<std::mutex> lock(lighting_mutex);
+        if (lighting && same(lighting->axis, axis) && same(lighting->light, light))
+        {
+            return lighting;
+        }
+    }
+    std::shared_ptr<const TurntableLighting> built(new TurntableLighting(build_turntable_lighting(normals, clusters.triangles, axis, light)));
+    std::lock_guard<std::mutex> lock(lighting_mutex);
+    lighting = built;
+    return built;
+}
+
+PreparedModel::PreparedModel(Model model) : _data(new Data(std::move(model)))
+{
+    _data->normals = build_normals(_data->model);
+    // the file's normals now live in normals.vertices
+    _data->model.set_normals(std::vector<Vec3f>());
+    _data->clusters = build_clusters(_data->model, _data->normals);
+}
+
+PreparedModel::~PreparedModel() = default;
+
+std::shared_ptr<const PreparedModel> PreparedModel::load(const RenderSpec &spec, std::string &error)
+{
+    try
+    {
+        return from_model(load_model_lod(spec.model_file, spec.triangle_budget(), spec.reorder, spec.lod_cache));
+    }
+    catch (const std::exception &e)
+    {
+        error = e.what();
+        return nullptr;
+    }
+}
+
+std::shared_ptr<const PreparedModel> PreparedModel::from_model(Model model)
+{
+    return std::shared_ptr<const PreparedModel>(new PreparedModel(std::move(model)));
+}
+
+int PreparedModel::nverts() const
+{
+    return _data->model.nverts();
+}
+
+int PreparedModel::nfaces() const
+{
+    return _data->model.nfaces();
+}
+
+size_t PreparedModel::memory_bytes() const
+{
+    return (size_t)_data->model.nverts() * sizeof(Vec3f) + (size_t)_data->model.nfaces() * sizeof(Triangle) +
+           (_data->normals.faces.size() + _data->normals.vertices.size()) * sizeof(Vec3f) +
+           (_data->clusters.triangles.size() + _data->normals.vertices.size()) * 3 * sizeof(float) +
+           _data->clusters.clusters.size() * sizeof(MeshCluster) + _data->clusters.triangles.size() * sizeof(int);
+}
+
+KernelLevel detect_kernel()
+{
+    return (KernelLevel)(KERNEL_SCALAR + GifDetectKernel());
+}
+
+void set_encoder_kernel(KernelLevel kernel)
+{
+    GifSetKernel(kernel == KERNEL_AUTO ? GifDetectKernel() : (GifKernel)(kernel - KERNEL_SCALAR));
+}
+
+namespace
+{
+    void flip_frame_vertical(std::vector<uint8_t> &frame, int width, int height, int bytes_per_pixel)
+    {
+        const int row_size = width * bytes_per_pixel;
+        const int half_height = height / 2;
+
+        for (int y = 0; y < half_height; y++)
+        {
+            int top_row_start = y * row_size;
+            int bottom_row_start = (height - 1 - y) * row_size;
+
+            std::swap_ranges(
+                frame.begin() + top_row_start,
+                frame.begin() + top_row_start + row_size,
+                frame.begin() + bottom_row_start);
+        }
+    }
+
+    bool write_to_sink(void *context, const uint8_t *data, size_t size)
+    {
+        return (*(const GifByteSink *)context)(data, size);
+    }
+
+    // An acquired frame buffer, returned to the encoder unless it was submitted, so an
+    // exception from rendering or on_frame cannot leave finish() waiting for it forever
+    struct AcquiredFrame
+    {
+        AsyncGifEncoder &encoder;
+        int buffer;
+
+        ~AcquiredFrame()
+        {
+            if (buffer >= 0)
+            {
+                encoder.release_frame(buffer);
+            }
+        }
+    };
+}
+
+struct Renderer::State
+{
+    RenderSpec spec;
+    bool configured = false;
+    // cleared after every frame
+    std::unique_ptr<DepthBuffer> depth;
+    GifPalette palette;
+    std::unique_ptr<AsyncGifEncoder> encoder;
+    int frames_saved = 0;
+
+    bool render_animation(const PreparedModel &model, Renderer &renderer, std::string &error, const FrameCallback &on_frame);
+};
+
+Renderer::Renderer() : _state(new State()) {}
+
+Renderer::~Renderer() = default;
+
+bool Renderer::configure(const RenderSpec &spec, std::string &error)
+{
+    if (!spec.validate(error))
+    {
+        return false;
+    }
+    KernelLevel supported = detect_kernel();
+    if (spec.kernel > supported)
+    {
+        error = std::string("kernel ") + kernel_name(spec.kernel) + " is not supported on this CPU, the best is " + kernel_name(supported);
+        return false;
+    }
+
+    State &state = *_state;
+    const RenderSpec old = state.spec;
+    state.spec = spec;
+    if (state.spec.kernel == KERNEL_AUTO)
+    {
+        state.spec.kernel = supported;
+    }
+    if (state.configured && old.width == spec.width && old.height == spec.height && old.msaa == spec.msaa &&
+        old.quantize_rgba == spec.quantize_rgba && old.color.r == spec.color.r && old.color.g == spec.color.g && old.color.b == spec.color.b)
+    {
+        state.encoder->set_min_changed_pixels(spec.min_changed_pixels);
+        return true;
+    }
+
+    state.depth.reset();
+    GifMakeRampPalette(spec.color.r, spec.color.g, spec.color.b, 8, &state.palette);
+    state.encoder.reset(new AsyncGifEncoder(spec.width, spec.height, state.palette, spec.quantize_rgba, spec.msaa));
+    state.encoder->set_min_changed_pixels(spec.min_changed_pixels);
+    state.configured = true;
+    return true;
+}
+
+const RenderSpec &Renderer::spec() const
+{
+    return _state->spec;
+}
+
+size_t Renderer::frame_size() const
+{
+    return (size_t)_state->spec.width * _state->spec.height * _state->spec.msaa;
+}
+
+DepthFormat Renderer::depth_format(const PreparedModel &model) const
+{
+    return choose_depth_format(model._data->model, _state->spec);
+}
+
+void Renderer::render_frame(const PreparedModel &model, int i, std::vector<uint8_t> &frame)
+{
+    State &state = *_state;
+    const RenderSpec &spec = state.spec;
+    DepthFormat format = depth_format(model);
+    if (!state.depth || state.depth->format != format)
+    {
+        state.depth.reset(new DepthBuffer(format, frame_size()));
+    }
+
+    frame.resize(frame_size());
+    std::fill(frame.begin(), frame.end(), BACKGROUND_SHADE);
+    std::shared_ptr<const TurntableLighting> lighting = model._data->turntable_lighting(spec.axis, spec.light_dir);
+    draw_model(model._data->model, model._data->clusters, *lighting, spec, spec.frame_angle(i), frame, *state.depth);
+    flip_frame_vertical(frame, spec.width, spec.height, spec.msaa);
+    state.depth->clear();
+}
+
+bool Renderer::render_gif(const PreparedModel &model, const std::string &output, std::string &error, const FrameCallback &on_frame)
+{
+    State &state = *_state;
+    if (!state.encoder->begin(output, state.spec.frame_delay()))
+    {
+        error = state.encoder->error();
+        return false;
+    }
+    return state.render_animation(model, *this, error, on_frame);
+}
+
+bool Renderer::render_gif(const PreparedModel &model, const GifByteSink &sink, std::string &error, const FrameCallback &on_frame)
+{
+    State &state = *_state;
+    if (!state.encoder->begin_sink(write_to_sink, (void *)&sink, state.spec.frame_delay()))
+    {
+        error = state.encoder->error();
+        return false;
+    }
+    return state.render_animation(model, *this, error, on_frame);
+}
+
+// renders every frame into the encoder's buffers, which begin has opened
+bool Renderer::State::render_animation(const PreparedModel &model, Renderer &renderer, std::string &error, const FrameCallback &on_frame)
+{
+    const uint32_t delay = spec.frame_delay();
+    try
+    {
+        for (int i = 0; i < spec.frames; i++)
+        {
+            ScopedTrace trace("render frame", i);
+            // blocks while the encoder is behind and every frame buffer is queued
+            AcquiredFrame acquired{*encoder, encoder->acquire_frame()};
+            if (acquired.buffer < 0)
+            {
+                break;
+            }
+            std::vector<uint8_t> &frame = encoder->frame(acquired.buffer);
+            renderer.render_frame(model, i, frame);
+            if (on_frame)
+            {
+                on_frame(i, frame);
+            }
+            int buffer = acquired.buffer;
+            acquired.buffer = -1;
+            if (!encoder->submit_frame(buffer, delay))
+            {
+                break;
+            }
+        }
+    }
+    catch (...)
+    {
+        // end the gif while its sink still exists, then let the caller see the error
+        encoder->finish();
+        throw;
+    }
+
+    bool ok = encoder->finish();
+    frames_saved = encoder->frames_saved();
+    if (!ok)
+    {
+        error = encoder->error();
+    }
+    return ok;
+}
+
+int Renderer::frames_saved() const
+{
+    return _state->frames_saved;
+}
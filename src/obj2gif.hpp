@@ -0,0 +1,85 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+#include "model.hpp"
+#include "render_spec.hpp"
+
+// Library interface of obj2gif (libobj2gif), for embedding the renderer in a long running
+// process. The steps of the command line tool are separate objects, so what is expensive to
+// set up stays warm across jobs:
+//   PreparedModel  a mesh loaded and prepared once, then shared by any number of renders
+//   Renderer       a render configuration with its depth buffer and gif encoder thread
+// A PreparedModel may be rendered by several threads at once; a Renderer is used by one
+// thread at a time.
+
+// Receives encoded gif bytes in order. Returns false to abort the encode.
+typedef std::function<bool(const uint8_t *data, size_t size)> GifByteSink;
+
+// Called with each rendered frame before it is encoded: samples palette indices per pixel,
+// top row first
+typedef std::function<void(int frame, const std::vector<uint8_t> &indices)> FrameCallback;
+
+// A mesh after level of detail and reordering, with its shading normals and culling clusters
+class PreparedModel
+{
+public:
+    // Loads spec.model_file at spec.triangle_budget(), reordered and cached as the spec asks.
+    // Returns null and sets error if the file cannot be read.
+    static std::shared_ptr<const PreparedModel> load(const RenderSpec &spec, std::string &error);
+    // prepares a mesh that is already in memory
+    static std::shared_ptr<const PreparedModel> from_model(Model model);
+
+    ~PreparedModel();
+    int nverts() const;
+    int nfaces() const;
+    // estimated heap size of the mesh, normals, clusters and lighting table, for cache budgets
+    size_t memory_bytes() const;
+
+private:
+    friend class Renderer;
+    struct Data;
+    std::unique_ptr<Data> _data;
+    explicit PreparedModel(Model model);
+};
+
+class Renderer
+{
+private:
+    struct State;
+    std::unique_ptr<State> _state;
+
+public:
+    Renderer();
+    ~Renderer();
+    Renderer(const Renderer &) = delete;
+    Renderer &operator=(const Renderer &) = delete;
+
+    // Validates and applies a render configuration; the model file and output fields are
+    // ignored. A kernel of KERNEL_AUTO resolves to the best the CPU supports. Buffers and the
+    // encoder are kept while the frame size, MSAA and palette stay the same.
+    bool configure(const RenderSpec &spec, std::string &error);
+    const RenderSpec &spec() const;
+
+    // size of a rendered frame: width * height * msaa palette indices
+    size_t frame_size() const;
+    // depth buffer format the configuration uses for a model
+    DepthFormat depth_format(const PreparedModel &model) const;
+    // Renders frame i of the animation into frame, top row first
+    void render_frame(const PreparedModel &model, int i, std::vector<uint8_t> &frame);
+
+    // Renders and encodes the whole animation, to a file ("-" streams to stdout) or to a
+    // sink called from the encoder thread. on_frame, if set, sees every rendered frame.
+    bool render_gif(const PreparedModel &model, const std::string &output, std::string &error, const FrameCallback &on_frame = FrameCallback());
+    bool render_gif(const PreparedModel &model, const GifByteSink &sink, std::string &error, const FrameCallback &on_frame = FrameCallback());
+    // frames the last render_gif merged into their predecessor or reused instead of encoding
+    int frames_saved() const;
+};
+
+// The best kernel level this CPU supports
+KernelLevel detect_kernel();
+// Sets the gif encoder kernels for the whole process (the rasterizer follows each spec's
+// kernel). Must not be called while gifs are being encoded.
+void set_encoder_kernel(KernelLevel kernel);
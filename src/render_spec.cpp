@@ -0,0 +1,677 @@
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include "lod.hpp"
+#include "render_spec.hpp"
+
+const char *RENDER_USAGE =
+    "usage: obj2gif [options] <model.obj>\n"
+    "  -o <output.gif> | -o -     output file, or stream to stdout\n"
+    "  --spec <file.json>         read options from a JSON render spec\n"
+    "  --size <w>x<h>             output size (default 512x512, at most 16384x16384 pixels)\n"
+    "  --width <w>, --height <h>\n"
+    "  --frames <n>               frames per animation (default 200, at most 65535)\n"
+    "  --delay <centiseconds>     frame delay (default spreads the animation over ~5s)\n"
+    "  --angles <start>:<end>     rotation range in degrees (default 0:360)\n"
+    "  --axis <x>,<y>,<z>         rotation axis (default 0,1,0)\n"
+    "  --camera-distance <k>      camera distance in model radii, above 1 (default 3)\n"
+    "  --light <x>,<y>,<z>        light direction (default 0.5,0.5,1)\n"
+    "  --color <r>,<g>,<b> | <rrggbb>\n"
+    "  --shading flat|gouraud     one shade per triangle, or smooth shading from vertex\n"
+    "                             normals (default flat)\n"
+    "  --lod auto|off|<triangles> decimate the model to a triangle budget (default auto:\n"
+    "                             meshes over width*height/2 triangles, at least 64, are\n"
+    "                             decimated; off renders every triangle)\n"
+    "  --reorder                  reorder the mesh for vertex cache locality at load time\n"
+    "  --lod-cache                store decimated or reordered models next to the model file\n"
+    "  --benchmark-reorder        compare frame times of a shuffled and a reordered mesh\n"
+    "  --serve <socket>           serve render requests on a Unix domain socket (no model\n"
+    "                             argument; see server.hpp for the protocol)\n"
+    "  --cache-mb <megabytes>     model cache size of --serve (default 256)\n"
+    "  --result-cache <dir>       reuse gifs of earlier renders of the same model and settings\n"
+    "  --result-cache-mb <megabytes>\n"
+    "                             result cache size (default 1024)\n"
+    "  --depth auto|16|32         depth buffer format: 16 bit unorm or 32 bit float reverse-Z\n"
+    "                             (default picks per model)\n"
+    "  --msaa 1|2|4               coverage samples per pixel for anti-aliasing\n"
+    "  --kernel auto|scalar|sse|avx2\n"
+    "                             SIMD level of the raster and encoder kernels (default\n"
+    "                             auto, the best the CPU supports)\n"
+    "  --stats table|json         log per-stage timings and counters at exit\n"
+    "  --trace <trace.json>       write a timeline of frames and stages for about:tracing\n"
+    "                             or ui.perfetto.dev\n"
+    "  --golden <file>            check frame and gif checksums against a golden file, or\n"
+    "                             record it if missing\n"
+    "  --rgba                     re-quantize frames from RGBA\n"
+    "  --min-change <pixels>      merge frames changing fewer pixels into the previous one\n"
+    "options taking a value also accept --option=value";
+
+namespace
+{
+    // a spec value: JSON scalars and flat arrays of numbers are all a spec needs
+    struct SpecValue
+    {
+        enum Kind
+        {
+            NUMBER,
+            STRING,
+            BOOLEAN,
+            NUMBERS
+        };
+        Kind kind = NUMBER;
+        double number = 0;
+        std::string string;
+        bool boolean = false;
+        std::vector<double> numbers;
+    };
+
+    bool expect_numbers(const std::string &key, const SpecValue &value, size_t count, std::string &error)
+    {
+        if (value.kind != SpecValue::NUMBERS || value.numbers.size() != count)
+        {
+            error = key + " expects " + std::to_string(count) + " numbers";
+            return false;
+        }
+        return true;
+    }
+
+    bool expect_number(const std::string &key, const SpecValue &value, std::string &error)
+    {
+        if (value.kind != SpecValue::NUMBER)
+        {
+            error = key + " expects a number";
+            return false;
+        }
+        return true;
+    }
+
+    // true if v is a whole number an int can hold, so casting it is exact
+    bool is_int(double v)
+    {
+        return v == std::floor(v) && v >= (double)INT_MIN && v <= (double)INT_MAX;
+    }
+
+    bool expect_int(const std::string &key, const SpecValue &value, std::string &error)
+    {
+        if (!expect_number(key, value, error))
+        {
+            return false;
+        }
+        if (!is_int(value.number))
+        {
+            error = key + " expects a whole number";
+            return false;
+        }
+        return true;
+    }
+
+    bool set_field(RenderSpec &spec, const std::string &key, const SpecValue &value, std::string &error)
+    {
+        if (key == "model" || key == "output" || key == "trace" || key == "golden")
+        {
+            if (value.kind != SpecValue::STRING)
+            {
+                error = key + " expects a string";
+                return false;
+            }
+            (key == "model" ? spec.model_file : key == "output" ? spec.output : key == "trace" ? spec.trace_file : spec.golden_file) = value.string;
+        }
+        else if (key == "width" || key == "height" || key == "frames" || key == "delay" || key == "min_change" || key == "lod" || key == "msaa")
+        {
+            if (!expect_int(key, value, error))
+            {
+                return false;
+            }
+            int n = (int)value.number;
+            if (key == "width")
+                spec.width = n;
+            else if (key == "height")
+                spec.height = n;
+            else if (key == "frames")
+                spec.frames = n;
+            else if (key == "delay")
+                spec.delay = n;
+            else if (key == "lod")
+                spec.lod_triangles = n;
+            else if (key == "msaa")
+                spec.msaa = n;
+            else
+                spec.min_changed_pixels = n;
+        }
+        else if (key == "camera_distance")
+        {
+            if (!expect_number(key, value, error))
+            {
+                return false;
+            }
+            spec.camera_distance = (float)value.number;
+        }
+        else if (key == "depth")
+        {
+            std::string format = value.kind == SpecValue::STRING ? value.string : value.kind == SpecValue::NUMBER && is_int(value.number) ? std::to_string((int)value.number) : "";
+            if (format == "auto")
+            {
+                spec.depth_format = DEPTH_AUTO;
+            }
+            else if (format == "16")
+            {
+                spec.depth_format = DEPTH_UNORM16;
+            }
+            else if (format == "32")
+            {
+                spec.depth_format = DEPTH_FLOAT32;
+            }
+            else
+            {
+                error = "depth expects \"auto\", 16 or 32";
+                return false;
+            }
+        }
+        else if (key == "shading")
+        {
+            if (value.kind != SpecValue::STRING || (value.string != "flat" && value.string != "gouraud"))
+            {
+                error = "shading expects \"flat\" or \"gouraud\"";
+                return false;
+            }
+            spec.shading = value.string == "gouraud" ? SHADING_GOURAUD : SHADING_FLAT;
+        }
+        else if (key == "stats")
+        {
+            if (value.kind != SpecValue::STRING || (value.string != "off" && value.string != "table" && value.string != "json"))
+            {
+                error = "stats expects \"off\", \"table\" or \"json\"";
+                return false;
+            }
+            spec.stats = value.string == "table" ? STATS_TABLE : value.string == "json" ? STATS_JSON : STATS_OFF;
+        }
+        else if (key == "kernel")
+        {
+            int level = KERNEL_AUTO;
+            while (level <= KERNEL_AVX2 && !(value.kind == SpecValue::STRING && value.string == kernel_name((KernelLevel)level)))
+            {
+                level++;
+            }
+            if (level > KERNEL_AVX2)
+            {
+                error = "kernel expects \"auto\", \"scalar\", \"sse\" or \"avx2\"";
+                return false;
+            }
+            spec.kernel = (KernelLevel)level;
+        }
+        else if (key == "angles")
+        {
+            if (!expect_numbers(key, value, 2, error))
+            {
+                return false;
+            }
+            spec.start_angle = (float)value.numbers[0];
+            spec.end_angle = (float)value.numbers[1];
+        }
+        else if (key == "axis" || key == "light")
+        {
+            if (!expect_numbers(key, value, 3, error))
+            {
+                return false;
+            }
+            Vec3f v((float)value.numbers[0], (float)value.numbers[1], (float)value.numbers[2]);
+            (key == "axis" ? spec.axis : spec.light_dir) = v;
+        }
+        else if (key == "color")
+        {
+            if (!expect_numbers(key, value, 3, error))
+            {
+                return false;
+            }
+            uint8_t rgb[3];
+            for (int i = 0; i < 3; i++)
+            {
+                if (!is_int(value.numbers[i]) || value.numbers[i] < 0 || value.numbers[i] > 255)
+                {
+                    error = "color components must be whole numbers in 0..255";
+                    return false;
+                }
+                rgb[i] = (uint8_t)value.numbers[i];
+            }
+            spec.color = Color{rgb[0], rgb[1], rgb[2], 255};
+        }
+        else if (key == "rgba" || key == "lod_cache" || key == "reorder")
+        {
+            if (value.kind != SpecValue::BOOLEAN)
+            {
+                error = key + " expects true or false";
+                return false;
+            }
+            (key == "rgba" ? spec.quantize_rgba : key == "reorder" ? spec.reorder : spec.lod_cache) = value.boolean;
+        }
+        else
+        {
+            error = "unknown render spec key: " + key;
+            return false;
+        }
+        return true;
+    }
+
+    // reads the subset of JSON a render spec uses: one object of numbers, strings,
+    // booleans and arrays of numbers
+    class SpecJsonReader
+    {
+    private:
+        const std::string &_json;
+        size_t _pos = 0;
+
+        void skip_space()
+        {
+            while (_pos < _json.size() && std::isspace((unsigned char)_json[_pos]))
+            {
+                _pos++;
+            }
+        }
+
+        bool consume(char c)
+        {
+            skip_space();
+            if (_pos < _json.size() && _json[_pos] == c)
+            {
+                _pos++;
+                return true;
+            }
+            return false;
+        }
+
+        bool fail(const std::string &what, std::string &error)
+        {
+            error = "render spec: " + what + " at offset " + std::to_string(_pos);
+            return false;
+        }
+
+        bool read_string(std::string &out, std::string &error)
+        {
+            if (!consume('"'))
+            {
+                return fail("expected string", error);
+            }
+            out.clear();
+            while (_pos < _json.size() && _json[_pos] != '"')
+            {
+                char c = _json[_pos++];
+                if (c == '\\' && _pos < _json.size())
+                {
+                    c = _json[_pos++];
+                    c = c == 'n' ? '\n' : c == 't' ? '\t' : c;
+                }
+                out += c;
+            }
+            if (_pos >= _json.size())
+            {
+                return fail("unterminated string", error);
+            }
+            _pos++;
+            return true;
+        }
+
+        bool read_number(double &out, std::string &error)
+        {
+            skip_space();
+            const char *begin = _json.c_str() + _pos;
+            char *end = nullptr;
+            out = std::strtod(begin, &end);
+            if (end == begin)
+            {
+                return fail("expected number", error);
+            }
+            _pos += end - begin;
+            return true;
+        }
+
+        bool read_value(SpecValue &value, std::string &error)
+        {
+            skip_space();
+            if (_pos >= _json.size())
+            {
+                return fail("expected value", error);
+            }
+            char c = _json[_pos];
+            if (c == '"')
+            {
+                value.kind = SpecValue::STRING;
+                return read_string(value.string, error);
+            }
+            if (c == '[')
+            {
+                _pos++;
+                value.kind = SpecValue::NUMBERS;
+                if (consume(']'))
+                {
+                    return true;
+                }
+                do
+                {
+                    double n;
+                    if (!read_number(n, error))
+                    {
+                        return false;
+                    }
+                    value.numbers.push_back(n);
+                } while (consume(','));
+                return consume(']') || fail("expected ]", error);
+            }
+            if (_json.compare(_pos, 4, "true") == 0 || _json.compare(_pos, 5, "false") == 0)
+            {
+                value.kind = SpecValue::BOOLEAN;
+                value.boolean = c == 't';
+                _pos += value.boolean ? 4 : 5;
+                return true;
+            }
+            value.kind = SpecValue::NUMBER;
+            return read_number(value.number, error);
+        }
+
+    public:
+        SpecJsonReader(const std::string &json) : _json(json) {}
+
+        bool read(RenderSpec &spec, std::string &error)
+        {
+            if (!consume('{'))
+            {
+                return fail("expected {", error);
+            }
+            if (!consume('}'))
+            {
+                do
+                {
+                    std::string key;
+                    SpecValue value;
+                    if (!read_string(key, error))
+                    {
+                        return false;
+                    }
+                    if (!consume(':'))
+                    {
+                        return fail("expected :", error);
+                    }
+                    if (!read_value(value, error) || !set_field(spec, key, value, error))
+                    {
+                        return false;
+                    }
+                } while (consume(','));
+                if (!consume('}'))
+                {
+                    return fail("expected }", error);
+                }
+            }
+            skip_space();
+            return _pos == _json.size() || fail("trailing characters", error);
+        }
+    };
+
+    // parses "1,2,3", "0:360" or "128x128" style flag values
+    bool parse_number_list(const std::string &text, SpecValue &value)
+    {
+        value.kind = SpecValue::NUMBERS;
+        const char *p = text.c_str();
+        while (*p)
+        {
+            char *end = nullptr;
+            value.numbers.push_back(std::strtod(p, &end));
+            if (end == p)
+            {
+                return false;
+            }
+            p = end;
+            if (*p == ',' || *p == ':' || *p == 'x')
+            {
+                p++;
+                if (!*p)
+                {
+                    return false;
+                }
+            }
+            else if (*p)
+            {
+                return false;
+            }
+        }
+        return !value.numbers.empty();
+    }
+
+    bool parse_hex_color(const std::string &text, SpecValue &value)
+    {
+        std::string hex = !text.empty() && text[0] == '#' ? text.substr(1) : text;
+        if (hex.size() != 6 || !std::all_of(hex.begin(), hex.end(), [](char c) { return std::isxdigit((unsigned char)c) != 0; }))
+        {
+            return false;
+        }
+        value.kind = SpecValue::NUMBERS;
+        for (int i = 0; i < 3; i++)
+        {
+            value.numbers.push_back((double)std::strtol(hex.substr(i * 2, 2).c_str(), nullptr, 16));
+        }
+        return true;
+    }
+}
+
+int RenderSpec::frame_delay() const
+{
+    return delay > 0 ? delay : std::max(2, 500 / frames);
+}
+
+int RenderSpec::triangle_budget() const
+{
+    return lod_triangles == 0 ? lod_triangle_budget(width, height) : std::max(0, lod_triangles);
+}
+
+float RenderSpec::frame_angle(int i) const
+{
+    const double pi = 3.14159265358979323846;
+    double degrees = start_angle + (double)(end_angle - start_angle) * i / frames;
+    return (float)(degrees * pi / 180);
+}
+
+bool RenderSpec::validate(std::string &error) const
+{
+    // gif dimensions and delays are 16 bit
+    if (width < 1 || height < 1 || width > 65535 || height > 65535)
+    {
+        error = "output size must be between 1 and 65535 pixels";
+        return false;
+    }
+    if ((int64_t)width * height > MAX_PIXELS)
+    {
+        error = "output size must be at most " + std::to_string(MAX_PIXELS) + " pixels, such as 16384x16384";
+        return false;
+    }
+    if (frames < 1 || frames > MAX_FRAMES)
+    {
+        error = "frames must be between 1 and " + std::to_string(MAX_FRAMES);
+        return false;
+    }
+    if (delay < 0 || delay > 65535)
+    {
+        error = "delay must be between 0 and 65535";
+        return false;
+    }
+    if (axis.norm() == 0 || light_dir.norm() == 0)
+    {
+        error = "axis and light direction must be non-zero";
+        return false;
+    }
+    // at 1 or less the camera sits inside the model's bounding sphere
+    if (!(camera_distance > 1))
+    {
+        error = "camera distance must be greater than 1";
+        return false;
+    }
+    if (!golden_file.empty() && output == "-")
+    {
+        error = "golden checks need a gif file, not stdout";
+        return false;
+    }
+    if (msaa != 1 && msaa != 2 && msaa != 4)
+    {
+        error = "msaa must be 1, 2 or 4";
+        return false;
+    }
+    if (min_changed_pixels < 0)
+    {
+        error = "min change must not be negative";
+        return false;
+    }
+    return true;
+}
+
+bool parse_render_spec_json(const std::string &json, RenderSpec &spec, std::string &error)
+{
+    return SpecJsonReader(json).read(spec, error);
+}
+
+const char *kernel_name(KernelLevel kernel)
+{
+    static const char *names[] = {"auto", "scalar", "sse", "avx2"};
+    return names[kernel];
+}
+
+bool load_render_spec(const std::string &filename, RenderSpec &spec, std::string &error)
+{
+    std::ifstream in(filename);
+    if (!in)
+    {
+        error = "cannot open render spec: " + filename;
+        return false;
+    }
+    std::stringstream contents;
+    contents << in.rdbuf();
+    return parse_render_spec_json(contents.str(), spec, error);
+}
+
+bool parse_render_args(int argc, char *argv[], RenderSpec &spec, std::string &error)
+{
+    for (int i = 1; i < argc; i++)
+    {
+        std::string arg = argv[i];
+        // --flag=value is the same as --flag value
+        size_t equals = arg.find('=');
+        bool inline_value = arg.compare(0, 2, "--") == 0 && equals != std::string::npos;
+        std::string text = inline_value ? arg.substr(equals + 1) : "";
+        if (inline_value)
+        {
+            arg.erase(equals);
+        }
+        if (!inline_value && (arg == "--rgba" || arg == "--lod-cache" || arg == "--reorder" || arg == "--benchmark-reorder"))
+        {
+            (arg == "--rgba" ? spec.quantize_rgba : arg == "--lod-cache" ? spec.lod_cache : arg == "--reorder" ? spec.reorder : spec.benchmark_reorder) = true;
+            continue;
+        }
+        if (arg.size() < 2 || arg[0] != '-')
+        {
+            if (!spec.model_file.empty())
+            {
+                error = "more than one model given";
+                return false;
+            }
+            spec.model_file = arg;
+            continue;
+        }
+        if (!inline_value)
+        {
+            if (i + 1 >= argc)
+            {
+                error = "missing value for " + arg;
+                return false;
+            }
+            text = argv[++i];
+        }
+
+        if (arg == "-o")
+        {
+            spec.output = text;
+            continue;
+        }
+        if (arg == "--lod" && (text == "auto" || text == "off"))
+        {
+            spec.lod_triangles = text == "auto" ? 0 : -1;
+            continue;
+        }
+        if (arg == "--serve")
+        {
+            spec.serve_socket = text;
+            continue;
+        }
+        if (arg == "--result-cache")
+        {
+            spec.result_cache_dir = text;
+            continue;
+        }
+        if (arg == "--cache-mb" || arg == "--result-cache-mb")
+        {
+            char *end = nullptr;
+            long mb = strtol(text.c_str(), &end, 10);
+            if (text.empty() || *end || mb < 0 || mb > (1 << 20))
+            {
+                error = arg + " expects megabytes between 0 and 1048576";
+                return false;
+            }
+            (arg == "--cache-mb" ? spec.model_cache_mb : spec.result_cache_mb) = (int)mb;
+            continue;
+        }
+        if (arg == "--spec")
+        {
+            if (!load_render_spec(text, spec, error))
+            {
+                return false;
+            }
+            continue;
+        }
+
+        // the remaining flags map onto the JSON keys of the same name
+        std::string key = arg.substr(2);
+        std::replace(key.begin(), key.end(), '-', '_');
+        if (key == "size")
+        {
+            SpecValue size;
+            if (!parse_number_list(text, size) || size.numbers.size() > 2 || !is_int(size.numbers[0]) || !is_int(size.numbers.back()))
+            {
+                error = "--size expects <w>x<h> or <n>";
+                return false;
+            }
+            spec.width = (int)size.numbers[0];
+            spec.height = (int)size.numbers.back();
+            continue;
+        }
+
+        SpecValue value;
+        bool ok = (key == "color" && parse_hex_color(text, value)) || parse_number_list(text, value);
+        if (!ok && (key == "depth" || key == "kernel" || key == "shading" || key == "stats" || key == "trace" || key == "golden"))
+        {
+            // keys taking a word
+            value = SpecValue();
+            value.kind = SpecValue::STRING;
+            value.string = text;
+            ok = true;
+        }
+        if (!ok)
+        {
+            error = "invalid value for " + arg + ": " + text;
+            return false;
+        }
+        if (value.numbers.size() == 1 && key != "color")
+        {
+            value.kind = SpecValue::NUMBER;
+            value.number = value.numbers[0];
+        }
+        if (key == "model" || key == "output" || key == "rgba" || key == "lod_cache" || key == "reorder" || !set_field(spec, key, value, error))
+        {
+            if (error.empty() || error.compare(0, 8, "unknown ") == 0)
+            {
+                error = "unknown option: " + arg;
+            }
+            return false;
+        }
+    }
+    return true;
+}
@@ -0,0 +1,125 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include "constants.hpp"
+#include "geometry.hpp"
+
+enum DepthFormat
+{
+    // 16 bit when its precision suffices for the model, float otherwise
+    DEPTH_AUTO,
+    DEPTH_UNORM16,
+    DEPTH_FLOAT32
+};
+
+// SIMD level of the rasterizer and gif encoder kernels, ordered by capability
+enum KernelLevel
+{
+    // the best level the CPU supports
+    KERNEL_AUTO,
+    KERNEL_SCALAR,
+    KERNEL_SSE,
+    KERNEL_AVX2
+};
+
+enum Shading
+{
+    // one shade per triangle
+    SHADING_FLAT,
+    // shades lit at the vertices and interpolated across each triangle
+    SHADING_GOURAUD
+};
+
+enum StatsOutput
+{
+    STATS_OFF,
+    STATS_TABLE,
+    STATS_JSON
+};
+
+// Everything that describes one turntable render. Filled from a JSON spec file and/or
+// command line flags, so cheap previews and full quality renders come from the same binary.
+struct RenderSpec
+{
+    std::string model_file;
+    // empty writes next to the model, "-" streams to stdout
+    std::string output;
+
+    int width = WIDTH;
+    int height = HEIGHT;
+    int frames = 200;
+    // gif delay per frame in hundredths of a second, 0 spreads the animation over ~5 seconds
+    int delay = 0;
+
+    // the model turns from start_angle to end_angle (degrees) around axis; the end angle
+    // itself is not rendered so a full turn loops seamlessly
+    float start_angle = 0;
+    float end_angle = 360;
+    Vec3f axis = Vec3f(0, 1, 0);
+    // camera distance from the model center, in model radii
+    float camera_distance = 3;
+    Vec3f light_dir = Vec3f(0.5f, 0.5f, 1);
+    Color color = Color{0, 255, 255, 255};
+    Shading shading = SHADING_FLAT;
+
+    // triangle budget: 0 derives it from the output size, negative renders the full mesh
+    int lod_triangles = 0;
+    // reorder vertices and triangles for cache locality at load time
+    bool reorder = false;
+    // keep decimated or reordered meshes next to the model for later renders
+    bool lod_cache = false;
+    // time rendering a shuffled copy of the model against its reordered copy instead of
+    // writing a gif (command line only)
+    bool benchmark_reorder = false;
+    // serve render requests on this Unix domain socket instead of rendering (command line
+    // only, see server.hpp), keeping up to model_cache_mb megabytes of prepared models
+    std::string serve_socket;
+    int model_cache_mb = 256;
+    // finished gifs are kept in this directory, up to result_cache_mb megabytes, and returned
+    // for repeated renders (command line only, see result_cache.hpp)
+    std::string result_cache_dir;
+    int result_cache_mb = 1024;
+
+    DepthFormat depth_format = DEPTH_AUTO;
+    // coverage samples per pixel (1, 2 or 4), each with its own depth; triangles are still
+    // shaded once and the samples are averaged when the frame is encoded
+    int msaa = 1;
+
+    // pins the SIMD kernels, e.g. to compare them or to time the scalar reference
+    KernelLevel kernel = KERNEL_AUTO;
+
+    // per-stage timings and counters logged at exit
+    StatsOutput stats = STATS_OFF;
+    // Chrome trace-event JSON of every frame and stage, if set
+    std::string trace_file;
+    // checksums to check the render against (see golden.hpp); recorded if the file is missing
+    std::string golden_file;
+
+    // re-quantize rendered frames from RGBA instead of writing the shade indices directly
+    bool quantize_rgba = false;
+    // frames changing fewer pixels than this are merged into the previous frame
+    int min_changed_pixels = 0;
+
+    int frame_delay() const;
+    // triangles to decimate the model to, 0 for no decimation
+    int triangle_budget() const;
+    // rotation of frame i in radians
+    float frame_angle(int i) const;
+    // checks ranges, returns false and sets error if the spec cannot be rendered
+    bool validate(std::string &error) const;
+};
+
+// Applies the keys of a JSON object such as
+//   {"frames": 24, "width": 128, "height": 128, "angles": [0, 360], "axis": [0, 1, 0]}
+// on top of spec. Unknown keys are an error so typos do not silently fall back to defaults.
+bool load_render_spec(const std::string &filename, RenderSpec &spec, std::string &error);
+bool parse_render_spec_json(const std::string &json, RenderSpec &spec, std::string &error);
+
+// Parses the command line into spec. Flags are applied in order, so flags after
+// --spec <file.json> override values from the file.
+bool parse_render_args(int argc, char *argv[], RenderSpec &spec, std::string &error);
+
+// "auto", "scalar", "sse" or "avx2", as the kernel key spells them
+const char *kernel_name(KernelLevel kernel);
+
+extern const char *RENDER_USAGE;
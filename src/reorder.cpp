@@ -0,0 +1,224 @@
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <numeric>
+#include <random>
+#include <vector>
+#include "clusters.hpp"
+#include "reorder.hpp"
+
+namespace
+{
+    // Forsyth, "Linear-Speed Vertex Cache Optimisation", with his published constants
+    const int FORSYTH_CACHE_SIZE = 32;
+    const float FORSYTH_CACHE_DECAY_POWER = 1.5f;
+    const float FORSYTH_LAST_TRIANGLE_SCORE = 0.75f;
+    const float FORSYTH_VALENCE_BOOST_SCALE = 2.0f;
+    const float FORSYTH_VALENCE_BOOST_POWER = 0.5f;
+
+    float forsyth_vertex_score(int cache_position, int remaining_triangles)
+    {
+        if (remaining_triangles == 0)
+        {
+            return -1;
+        }
+        float score = 0;
+        if (cache_position >= 0)
+        {
+            if (cache_position < 3)
+            {
+                // the triangle just drawn: a little penalty so its neighbours are not
+                // always favoured over slightly older vertices
+                score = FORSYTH_LAST_TRIANGLE_SCORE;
+            }
+            else
+            {
+                float scaler = 1.0f / (FORSYTH_CACHE_SIZE - 3);
+                score = std::pow(1.0f - (cache_position - 3) * scaler, FORSYTH_CACHE_DECAY_POWER);
+            }
+        }
+        // favour vertices with few triangles left so they can leave the cache for good
+        score += FORSYTH_VALENCE_BOOST_SCALE * std::pow((float)remaining_triangles, -FORSYTH_VALENCE_BOOST_POWER);
+        return score;
+    }
+
+    // returns the triangles in vertex cache order
+    std::vector<int> forsyth_order(const std::vector<int> &indices, int nverts)
+    {
+        const int ntris = (int)indices.size() / 3;
+
+        // triangles of each vertex; the first remaining[v] entries are the ones not yet emitted
+        std::vector<int> offsets(nverts + 1, 0);
+        for (int v : indices)
+        {
+            offsets[v + 1]++;
+        }
+        std::partial_sum(offsets.begin(), offsets.end(), offsets.begin());
+        std::vector<int> remaining(nverts, 0);
+        std::vector<int> vertex_triangles(indices.size());
+        for (int t = 0; t < ntris; t++)
+        {
+            for (int k = 0; k < 3; k++)
+            {
+                int v = indices[t * 3 + k];
+                vertex_triangles[offsets[v] + remaining[v]++] = t;
+            }
+        }
+
+        std::vector<int> cache_position(nverts, -1);
+        std::vector<float> vertex_score(nverts);
+        for (int v = 0; v < nverts; v++)
+        {
+            vertex_score[v] = forsyth_vertex_score(-1, remaining[v]);
+        }
+        std::vector<uint8_t> emitted(ntris, 0);
+
+        std::vector<int> order;
+        order.reserve(ntris);
+        std::vector<int> cache;
+        std::vector<int> next_cache;
+        int best = -1;
+        int scan = 0;
+        while ((int)order.size() < ntris)
+        {
+            if (best < 0)
+            {
+                // dead end: nothing in the cache has triangles left, restart at the next unused one
+                while (emitted[scan])
+                {
+                    scan++;
+                }
+                best = scan;
+            }
+
+            int t = best;
+            emitted[t] = 1;
+            order.push_back(t);
+
+            // the triangle's vertices go to the front of the cache, the rest shift back
+            next_cache.clear();
+            for (int k = 0; k < 3; k++)
+            {
+                int v = indices[t * 3 + k];
+                next_cache.push_back(v);
+                int *list = &vertex_triangles[offsets[v]];
+                int *end = list + remaining[v];
+                *std::find(list, end, t) = end[-1];
+                remaining[v]--;
+            }
+            for (int v : cache)
+            {
+                if (std::find(next_cache.begin(), next_cache.begin() + 3, v) == next_cache.begin() + 3)
+                {
+                    next_cache.push_back(v);
+                }
+            }
+
+            for (size_t i = 0; i < next_cache.size(); i++)
+            {
+                int v = next_cache[i];
+                cache_position[v] = i < (size_t)FORSYTH_CACHE_SIZE ? (int)i : -1;
+                vertex_score[v] = forsyth_vertex_score(cache_position[v], remaining[v]);
+            }
+
+            // rescore the triangles touching the cache and pick the best for the next step
+            best = -1;
+            float best_score = -1;
+            for (int v : next_cache)
+            {
+                for (int i = offsets[v]; i < offsets[v] + remaining[v]; i++)
+                {
+                    int n = vertex_triangles[i];
+                    float score = vertex_score[indices[n * 3]] + vertex_score[indices[n * 3 + 1]] + vertex_score[indices[n * 3 + 2]];
+                    if (score > best_score)
+                    {
+                        best_score = score;
+                        best = n;
+                    }
+                }
+            }
+
+            if (next_cache.size() > (size_t)FORSYTH_CACHE_SIZE)
+            {
+                next_cache.resize(FORSYTH_CACHE_SIZE);
+            }
+            std::swap(cache, next_cache);
+        }
+        return order;
+    }
+
+    // rebuilds the model with vertex new_vertex[i] = old vertex i and faces in face_order
+    Model remap_model(Model &model, const std::vector<int> &new_vertex, const std::vector<int> &face_order)
+    {
+        std::vector<Vec3f> verts(model.nverts());
+        for (int i = 0; i < model.nverts(); i++)
+        {
+            verts[new_vertex[i]] = model.vert(i);
+        }
+        std::vector<Triangle> faces;
+        faces.reserve(face_order.size());
+        for (int f : face_order)
+        {
+            Triangle face = model.face(f);
+            for (int &v : face)
+            {
+                v = new_vertex[v];
+            }
+            faces.push_back(face);
+        }
+        Model result(std::move(verts), std::move(faces));
+        result.copy_bounds(model);
+        if (model.has_normals())
+        {
+            std::vector<Vec3f> normals(model.nverts());
+            for (int i = 0; i < model.nverts(); i++)
+            {
+                normals[new_vertex[i]] = model.normal(i);
+            }
+            result.set_normals(std::move(normals));
+        }
+        return result;
+    }
+}
+
+Model reorder_model(Model &model)
+{
+    // vertices along a Morton curve of their positions
+    std::vector<std::pair<uint32_t, int>> keys(model.nverts());
+    for (int i = 0; i < model.nverts(); i++)
+    {
+        keys[i] = std::make_pair(morton_code(model.vert(i), model), i);
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<int> new_vertex(model.nverts());
+    for (int i = 0; i < model.nverts(); i++)
+    {
+        new_vertex[keys[i].second] = i;
+    }
+
+    // triangles in vertex cache order
+    std::vector<int> indices;
+    indices.reserve((size_t)model.nfaces() * 3);
+    for (int i = 0; i < model.nfaces(); i++)
+    {
+        for (int v : model.face(i))
+        {
+            indices.push_back(new_vertex[v]);
+        }
+    }
+    std::vector<int> face_order = forsyth_order(indices, model.nverts());
+
+    return remap_model(model, new_vertex, face_order);
+}
+
+Model shuffle_model(Model &model, unsigned seed)
+{
+    std::mt19937 rng(seed);
+    std::vector<int> new_vertex(model.nverts());
+    std::iota(new_vertex.begin(), new_vertex.end(), 0);
+    std::shuffle(new_vertex.begin(), new_vertex.end(), rng);
+    std::vector<int> face_order(model.nfaces());
+    std::iota(face_order.begin(), face_order.end(), 0);
+    std::shuffle(face_order.begin(), face_order.end(), rng);
+    return remap_model(model, new_vertex, face_order);
+}
@@ -0,0 +1,12 @@
+#pragma once
+#include "model.hpp"
+
+// Reorders the mesh for locality without changing its shape. Vertices are sorted along a
+// Morton curve so nearby vertices sit next to each other in memory, and triangles are put
+// in Forsyth's vertex cache order so consecutive triangles reuse recently transformed
+// vertices. build_clusters keeps this order within each cluster.
+Model reorder_model(Model &model);
+
+// Randomly permutes vertices and triangles, like scanned data often arrives; used to
+// benchmark reorder_model.
+Model shuffle_model(Model &model, unsigned seed);
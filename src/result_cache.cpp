@@ -0,0 +1,235 @@
+#include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include "hash.hpp"
+#include "result_cache.hpp"
+
+namespace
+{
+    // skips a chain of data sub-blocks, ending after the terminating empty block
+    bool skip_sub_blocks(const std::vector<uint8_t> &gif, size_t &pos)
+    {
+        while (pos < gif.size())
+        {
+            uint8_t size = gif[pos++];
+            if (size == 0)
+            {
+                return true;
+            }
+            pos += size;
+        }
+        return false;
+    }
+
+    // Offsets of the delay field of every graphic control extension. False if the data is
+    // not a complete gif.
+    bool find_delays(const std::vector<uint8_t> &gif, std::vector<size_t> &delays)
+    {
+        if (gif.size() < 13 || memcmp(gif.data(), "GIF89a", 6) != 0)
+        {
+            return false;
+        }
+        size_t pos = 13;
+        if (gif[10] & 0x80)
+        {
+            // global color table
+            pos += 3 * ((size_t)2 << (gif[10] & 7));
+        }
+        while (pos < gif.size())
+        {
+            uint8_t block = gif[pos++];
+            if (block == 0x3b)
+            {
+                return true;
+            }
+            if (block == 0x21 && pos < gif.size())
+            {
+                uint8_t label = gif[pos++];
+                if (label == 0xf9 && pos + 4 < gif.size() && gif[pos] == 4)
+                {
+                    delays.push_back(pos + 2);
+                }
+            }
+            else if (block == 0x2c && pos + 9 < gif.size())
+            {
+                uint8_t flags = gif[pos + 8];
+                pos += 9;
+                if (flags & 0x80)
+                {
+                    pos += 3 * ((size_t)2 << (flags & 7));
+                }
+                // LZW minimum code size
+                pos++;
+            }
+            else
+            {
+                return false;
+            }
+            if (!skip_sub_blocks(gif, pos))
+            {
+                return false;
+            }
+        }
+        return false;
+    }
+
+    uint32_t read_delay(const std::vector<uint8_t> &gif, size_t offset)
+    {
+        return gif[offset] | ((uint32_t)gif[offset + 1] << 8);
+    }
+
+    void write_delay(std::vector<uint8_t> &gif, size_t offset, uint32_t delay)
+    {
+        gif[offset] = (uint8_t)(delay & 0xff);
+        gif[offset + 1] = (uint8_t)(delay >> 8);
+    }
+}
+
+std::string ResultCache::path(const std::string &key) const
+{
+    return _dir + "/" + key + ".gif";
+}
+
+bool ResultCache::key(const RenderSpec &spec, std::string &key, std::string &error) const
+{
+    uint64_t mesh;
+    if (!hash_file(spec.model_file, mesh, error))
+    {
+        return false;
+    }
+    // every field that changes the gif's pixels or frame structure; the kernel does not, and
+    // the delay is applied when an entry is loaded
+    char params[512];
+    int length = snprintf(params, sizeof(params),
+                          "v%d %dx%d f%d a%.9g:%.9g axis%.9g,%.9g,%.9g cam%.9g light%.9g,%.9g,%.9g rgb%d,%d,%d "
+                          "shading%d lod%d r%d depth%d msaa%d rgba%d min%d",
+                          RESULT_CACHE_VERSION, spec.width, spec.height, spec.frames, spec.start_angle, spec.end_angle,
+                          spec.axis.x, spec.axis.y, spec.axis.z, spec.camera_distance, spec.light_dir.x, spec.light_dir.y, spec.light_dir.z,
+                          spec.color.r, spec.color.g, spec.color.b, (int)spec.shading, spec.triangle_budget(), (int)spec.reorder, (int)spec.depth_format,
+                          spec.msaa, (int)spec.quantize_rgba, spec.min_changed_pixels);
+    char text[40];
+    snprintf(text, sizeof(text), "%016llx-%016llx", (unsigned long long)mesh,
+             (unsigned long long)content_hash((const uint8_t *)params, (size_t)length));
+    key = text;
+    return true;
+}
+
+bool ResultCache::load(const std::string &key, uint32_t delay, std::vector<uint8_t> &gif)
+{
+    std::string filename = path(key);
+    std::ifstream in(filename, std::ios::binary);
+    if (!in)
+    {
+        return false;
+    }
+    gif.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    std::vector<size_t> delays;
+    if (!find_delays(gif, delays))
+    {
+        gif.clear();
+        return false;
+    }
+    for (size_t offset : delays)
+    {
+        // stored delays count frames
+        uint32_t scaled = read_delay(gif, offset) * delay;
+        if (scaled > 0xffff)
+        {
+            gif.clear();
+            return false;
+        }
+        write_delay(gif, offset, scaled);
+    }
+    // hits count as uses for eviction
+    utime(filename.c_str(), nullptr);
+    return true;
+}
+
+bool ResultCache::store(const std::string &key, uint32_t delay, const std::vector<uint8_t> &gif, std::string &error)
+{
+    std::vector<uint8_t> stored = gif;
+    std::vector<size_t> delays;
+    if (delay == 0 || !find_delays(stored, delays))
+    {
+        error = "not an animated gif";
+        return false;
+    }
+    for (size_t offset : delays)
+    {
+        // the encoder merges a frame into its predecessor only while the sum fits 16 bits,
+        // so a frame this long may have been cut short where another delay would not
+        uint32_t frame_delay = read_delay(stored, offset);
+        if (frame_delay % delay != 0 || frame_delay + delay > 0xffff)
+        {
+            error = "frame delays reach the 16 bit limit";
+            return false;
+        }
+        write_delay(stored, offset, frame_delay / delay);
+    }
+
+    if (mkdir(_dir.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        error = "cannot create result cache directory: " + _dir;
+        return false;
+    }
+    static std::atomic<int> writes(0);
+    std::string filename = path(key);
+    std::string temporary = filename + ".tmp" + std::to_string(getpid()) + "." + std::to_string(writes++);
+    FILE *f = fopen(temporary.c_str(), "wb");
+    bool ok = f && fwrite(stored.data(), 1, stored.size(), f) == stored.size();
+    ok = f && fclose(f) == 0 && ok;
+    if (!ok || rename(temporary.c_str(), filename.c_str()) != 0)
+    {
+        remove(temporary.c_str());
+        error = "cannot write " + filename;
+        return false;
+    }
+    evict();
+    return true;
+}
+
+void ResultCache::evict()
+{
+    struct CachedFile
+    {
+        int64_t mtime;
+        uint64_t size;
+        std::string name;
+    };
+    std::vector<CachedFile> files;
+    uint64_t total = 0;
+    DIR *dir = opendir(_dir.c_str());
+    if (!dir)
+    {
+        return;
+    }
+    while (dirent *entry = readdir(dir))
+    {
+        std::string name = entry->d_name;
+        struct stat st;
+        if (name.size() > 4 && name.compare(name.size() - 4, 4, ".gif") == 0 &&
+            stat((_dir + "/" + name).c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        {
+            files.push_back(CachedFile{(int64_t)st.st_mtime, (uint64_t)st.st_size, name});
+            total += (uint64_t)st.st_size;
+        }
+    }
+    closedir(dir);
+
+    std::sort(files.begin(), files.end(), [](const CachedFile &a, const CachedFile &b) { return a.mtime < b.mtime; });
+    for (size_t i = 0; i < files.size() && total > _capacity; i++)
+    {
+        if (remove((_dir + "/" + files[i].name).c_str()) == 0)
+        {
+            total -= files[i].size;
+        }
+    }
+}
@@ -0,0 +1,42 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "render_spec.hpp"
+
+// Bumped whenever a change to the rasterizer or the encoder changes the gifs they write, so
+// results of older builds are never returned
+const int RESULT_CACHE_VERSION = 4;
+
+// On-disk cache of finished gifs, in one directory of <mesh hash>-<render hash>.gif files.
+// The key hashes the model file's bytes, every spec field that affects the output except the
+// frame delay, and RESULT_CACHE_VERSION, so a hit needs neither parsing nor rendering.
+// Gifs are stored with their frame delays divided by the frame delay they were rendered
+// with, which leaves how many frames each gif frame spans; a request that changes only the
+// delay is served from the same entry with the delays scaled back up. Entries whose merged
+// frames ran into the 16 bit delay limit are not stored that way, since another delay would
+// merge them differently.
+// The directory is kept under capacity_bytes by deleting the least recently used files;
+// hits refresh a file's modification time. Files are written to a temporary name and then
+// renamed, so several processes can share a directory.
+class ResultCache
+{
+private:
+    std::string _dir;
+    uint64_t _capacity;
+
+    std::string path(const std::string &key) const;
+    void evict();
+
+public:
+    ResultCache(const std::string &dir, uint64_t capacity_bytes) : _dir(dir), _capacity(capacity_bytes) {}
+
+    // The key of spec's render. Returns false with error set if the model cannot be read.
+    bool key(const RenderSpec &spec, std::string &key, std::string &error) const;
+    // Reads the gif stored for key with its frame delays set for delay. False, with gif
+    // empty, on a miss.
+    bool load(const std::string &key, uint32_t delay, std::vector<uint8_t> &gif);
+    // Stores a gif rendered with frame delay delay. Returns false with error set if it was
+    // not stored.
+    bool store(const std::string &key, uint32_t delay, const std::vector<uint8_t> &gif, std::string &error);
+};
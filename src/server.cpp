@@ -0,0 +1,351 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "model_cache.hpp"
+#include "obj2gif.hpp"
+#include "result_cache.hpp"
+#include "server.hpp"
+#include "stats.hpp"
+#include "util.hpp"
+
+namespace
+{
+    // requests are one short line of JSON
+    const size_t MAX_REQUEST_BYTES = 64 * 1024;
+    // a client that stops sending mid-request, or stops reading its gif, gives its worker
+    // back after this long without progress
+    const int REQUEST_TIMEOUT_SECONDS = 10;
+    const int SEND_TIMEOUT_SECONDS = 30;
+    // one request may not hold a worker for hours or allocate gigabytes: at most 2048x2048
+    // at msaa 1 or 1024x1024 at msaa 4, for up to 1000 frames
+    const int64_t MAX_REQUEST_SAMPLES = 2048 * 2048;
+    const int MAX_REQUEST_FRAMES = 1000;
+
+    struct Server
+    {
+        RenderSpec defaults;
+        ModelCache cache;
+        // finished gifs, if the daemon was started with --result-cache
+        std::unique_ptr<ResultCache> results;
+        std::atomic<uint64_t> requests{0};
+        std::atomic<uint64_t> failed{0};
+        std::atomic<uint64_t> result_hits{0};
+        std::atomic<uint64_t> result_misses{0};
+
+        // accepted connections waiting for a worker
+        std::mutex mutex;
+        std::condition_variable queued;
+        std::deque<int> connections;
+
+        explicit Server(const RenderSpec &spec) : defaults(spec), cache((size_t)spec.model_cache_mb << 20)
+        {
+            if (!spec.result_cache_dir.empty())
+            {
+                results.reset(new ResultCache(spec.result_cache_dir, (uint64_t)spec.result_cache_mb << 20));
+            }
+        }
+    };
+
+    bool write_all(int fd, const uint8_t *data, size_t size)
+    {
+        while (size > 0)
+        {
+            // a client that hangs up fails the write instead of raising SIGPIPE
+            ssize_t n = send(fd, data, size, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                return false;
+            }
+            data += n;
+            size -= (size_t)n;
+        }
+        return true;
+    }
+
+    bool write_text(int fd, const std::string &text)
+    {
+        return write_all(fd, (const uint8_t *)text.data(), text.size());
+    }
+
+    // reads up to the first newline or the end of the stream
+    bool read_request(int fd, std::string &request)
+    {
+        char buffer[4096];
+        while (request.find('\n') == std::string::npos)
+        {
+            ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+            if (n < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n < 0)
+            {
+                return false;
+            }
+            if (n == 0)
+            {
+                break;
+            }
+            request.append(buffer, (size_t)n);
+            if (request.size() > MAX_REQUEST_BYTES)
+            {
+                return false;
+            }
+        }
+        request = request.substr(0, request.find('\n'));
+        return true;
+    }
+
+    std::string metrics_json(Server &server)
+    {
+        ModelCache::Metrics cache = server.cache.metrics();
+        char text[512];
+        snprintf(text, sizeof(text),
+                 "{\"requests\": %llu, \"failed\": %llu, \"cache\": {\"hits\": %llu, \"misses\": %llu, \"evictions\": %llu, "
+                 "\"entries\": %zu, \"bytes\": %zu, \"capacity_bytes\": %zu}",
+                 (unsigned long long)server.requests, (unsigned long long)server.failed, (unsigned long long)cache.hits,
+                 (unsigned long long)cache.misses, (unsigned long long)cache.evictions, cache.entries, cache.bytes, cache.capacity_bytes);
+        std::string json = text;
+        if (server.results)
+        {
+            snprintf(text, sizeof(text), ", \"results\": {\"hits\": %llu, \"misses\": %llu}",
+                     (unsigned long long)server.result_hits, (unsigned long long)server.result_misses);
+            json += text;
+        }
+        if (stats().enabled)
+        {
+            json += ", \"stats\": " + stats_report(true);
+        }
+        return json + "}\n";
+    }
+
+    // Renders one request onto the connection. Returns false with error set if it could not
+    // be served; errors found before the gif starts are sent to the client.
+    bool serve(Server &server, Renderer &renderer, int fd, std::string &error)
+    {
+        std::string request;
+        if (!read_request(fd, request))
+        {
+            error = "cannot read request";
+            return false;
+        }
+        if (request == "metrics")
+        {
+            write_text(fd, "OK\n" + metrics_json(server));
+            return true;
+        }
+
+        auto started = std::chrono::steady_clock::now();
+        RenderSpec spec = server.defaults;
+        spec.model_file.clear();
+        spec.output.clear();
+        spec.lod_cache = false;
+        bool ok = parse_render_spec_json(request, spec, error);
+        if (ok && spec.model_file.empty())
+        {
+            error = "request has no model";
+            ok = false;
+        }
+        if (ok && (!spec.trace_file.empty() || !spec.golden_file.empty()))
+        {
+            error = "trace and golden files are not supported in requests";
+            ok = false;
+        }
+        // both write next to paths the client names; the gif goes back over the socket and
+        // the lod cache stays a server-side setting
+        if (ok && (!spec.output.empty() || spec.lod_cache))
+        {
+            error = "output and lod_cache are not supported in requests";
+            ok = false;
+        }
+        spec.lod_cache = server.defaults.lod_cache;
+        if (ok && ((int64_t)spec.width * spec.height * spec.msaa > MAX_REQUEST_SAMPLES || spec.frames > MAX_REQUEST_FRAMES))
+        {
+            error = "request exceeds the server limits of " + std::to_string(MAX_REQUEST_SAMPLES) + " pixels times msaa samples and " +
+                    std::to_string(MAX_REQUEST_FRAMES) + " frames";
+            ok = false;
+        }
+        ok = ok && renderer.configure(spec, error);
+
+        std::string result_key;
+        std::vector<uint8_t> gif;
+        ok = ok && (!server.results || server.results->key(spec, result_key, error));
+        if (ok && server.results && server.results->load(result_key, spec.frame_delay(), gif))
+        {
+            server.result_hits++;
+            if (!write_text(fd, "OK\n") || !write_all(fd, gif.data(), gif.size()))
+            {
+                error = "cannot send gif for " + spec.model_file;
+                return false;
+            }
+            std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+            Log("Served " + spec.model_file + " (result cache hit) in " + std::to_string(elapsed.count()) + " ms");
+            return true;
+        }
+
+        bool hit = false;
+        std::shared_ptr<const PreparedModel> model;
+        if (ok)
+        {
+            model = server.cache.get(spec, error, &hit);
+        }
+        if (!model)
+        {
+            write_text(fd, "ERROR " + error + "\n");
+            return false;
+        }
+
+        // with a result cache the gif is kept while it streams out, and stored once complete
+        bool keep = server.results != nullptr;
+        auto sink = [fd, keep, &gif](const uint8_t *data, size_t size)
+        {
+            if (keep)
+            {
+                gif.insert(gif.end(), data, data + size);
+            }
+            return write_all(fd, data, size);
+        };
+        if (!write_text(fd, "OK\n") || !renderer.render_gif(*model, sink, error))
+        {
+            error = "cannot send gif for " + spec.model_file;
+            return false;
+        }
+        if (server.results)
+        {
+            server.result_misses++;
+            std::string store_error;
+            if (!server.results->store(result_key, spec.frame_delay(), gif, store_error))
+            {
+                Log("Gif not stored in result cache: " + store_error);
+            }
+        }
+        std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - started;
+        Log("Served " + spec.model_file + " (model cache " + (hit ? "hit" : "miss") + ") in " + std::to_string(elapsed.count()) + " ms");
+        return true;
+    }
+
+    void run_worker(Server &server)
+    {
+        std::unique_ptr<Renderer> renderer(new Renderer());
+        while (true)
+        {
+            int fd;
+            {
+                std::unique_lock<std::mutex> lock(server.mutex);
+                server.queued.wait(lock, [&server] { return !server.connections.empty(); });
+                fd = server.connections.front();
+                server.connections.pop_front();
+            }
+            server.requests++;
+            std::string error;
+            bool ok = false;
+            // a request too big to allocate, or a model that fails to load, throws; it must
+            // fail that request only, not take the daemon and every other request down
+            try
+            {
+                ok = serve(server, *renderer, fd, error);
+            }
+            catch (const std::exception &e)
+            {
+                error = e.what();
+                write_text(fd, "ERROR " + error + "\n");
+                // the renderer may have been left half configured
+                renderer.reset(new Renderer());
+            }
+            if (!ok)
+            {
+                server.failed++;
+                Log("Request failed: " + error);
+            }
+            close(fd);
+        }
+    }
+}
+
+bool run_server(const RenderSpec &defaults, const std::string &socket_path, std::string &error)
+{
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        error = "socket path is too long: " + socket_path;
+        return false;
+    }
+    memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+
+    // a socket left behind by an earlier run would make bind fail
+    struct stat st;
+    if (stat(socket_path.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        unlink(socket_path.c_str());
+    }
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, (const sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0)
+    {
+        error = "cannot listen on " + socket_path + ": " + strerror(errno);
+        if (listener >= 0)
+        {
+            close(listener);
+        }
+        return false;
+    }
+
+    // the workers are detached, so the server lives for the rest of the process
+    Server &server = *new Server(defaults);
+    int workers = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int i = 0; i < workers; i++)
+    {
+        std::thread(run_worker, std::ref(server)).detach();
+    }
+    Log("Listening on " + socket_path + " with " + std::to_string(workers) + " workers");
+
+    while (true)
+    {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            error = std::string("accept failed: ") + strerror(errno);
+            close(listener);
+            return false;
+        }
+        timeval receive_timeout = {REQUEST_TIMEOUT_SECONDS, 0};
+        timeval send_timeout = {SEND_TIMEOUT_SECONDS, 0};
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &receive_timeout, sizeof(receive_timeout)) < 0 ||
+            setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &send_timeout, sizeof(send_timeout)) < 0)
+        {
+            Log(std::string("Cannot set connection timeouts: ") + strerror(errno));
+            close(fd);
+            continue;
+        }
+        {
+            std::lock_guard<std::mutex> lock(server.mutex);
+            server.connections.push_back(fd);
+        }
+        server.queued.notify_one();
+    }
+}
@@ -0,0 +1,17 @@
+#pragma once
+#include <string>
+#include "render_spec.hpp"
+
+// Render daemon on a Unix domain socket, so a web tier can keep parsed models and render
+// threads warm instead of starting obj2gif per request. One request per connection:
+//   request:  a JSON render spec on one line, the keys of --spec files with "model"
+//             required, applied on top of the daemon's own flags; or the line "metrics"
+//   response: "OK\n" followed by the gif (or the metrics JSON), or "ERROR <message>\n",
+//             then the connection is closed
+// Models come from a ModelCache of defaults.model_cache_mb megabytes, and finished gifs from
+// a ResultCache when defaults.result_cache_dir is set. Requests are served
+// by one worker per hardware thread, each with its own Renderer. A request is limited to
+// 2048x2048 pixels times msaa samples and 1000 frames, and a connection that makes no progress
+// reading its request (10 s) or its gif (30 s) is dropped. Runs until killed; returns
+// false with error set if the socket cannot be set up.
+bool run_server(const RenderSpec &defaults, const std::string &socket_path, std::string &error);
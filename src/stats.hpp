@@ -0,0 +1,187 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include "trace.hpp"
+
+// Wall time per pipeline stage and event counters, shared by the render and encoder
+// threads. Everything is off until stats_enable(): a disabled ScopedTimer or count_stat
+// costs one predictable branch, so the hooks stay in release builds.
+enum StatsTimer
+{
+    TIMER_PARSE,
+    TIMER_TRANSFORM,
+    TIMER_RASTER,
+    // render thread blocked in acquire_frame until the encoder frees a buffer
+    TIMER_WAIT_ENCODER,
+    TIMER_PALETTE,
+    TIMER_THRESHOLD,
+    // change detection between frames, including the MSAA resolve
+    TIMER_DELTA,
+    TIMER_LZW,
+    TIMER_IO,
+    TIMER_COUNT
+};
+
+enum StatsCounter
+{
+    COUNTER_TRIANGLES_CULLED,
+    COUNTER_TRIANGLES_DRAWN,
+    // depth test passes, per sample with MSAA
+    COUNTER_PIXELS_SHADED,
+    COUNTER_BYTES_WRITTEN,
+    COUNTER_COUNT
+};
+
+struct Stats
+{
+    bool enabled = false;
+    std::atomic<uint64_t> nanoseconds[TIMER_COUNT];
+    std::atomic<uint64_t> calls[TIMER_COUNT];
+    std::atomic<uint64_t> counters[COUNTER_COUNT];
+
+    Stats()
+    {
+        for (int i = 0; i < TIMER_COUNT; i++)
+        {
+            nanoseconds[i] = 0;
+            calls[i] = 0;
+        }
+        for (int i = 0; i < COUNTER_COUNT; i++)
+        {
+            counters[i] = 0;
+        }
+    }
+};
+
+inline Stats &stats()
+{
+    static Stats instance;
+    return instance;
+}
+
+// must be called before any thread that records stats is started
+inline void stats_enable()
+{
+    stats().enabled = true;
+}
+
+inline void count_stat(StatsCounter counter, uint64_t n)
+{
+    if (stats().enabled)
+    {
+        stats().counters[counter].fetch_add(n, std::memory_order_relaxed);
+    }
+}
+
+inline const char *stats_timer_name(int timer)
+{
+    static const char *names[TIMER_COUNT] = {"parse", "transform", "raster", "wait_encoder", "palette", "threshold", "delta", "lzw", "io"};
+    return names[timer];
+}
+
+// Adds the time from construction to destruction to a stage, and records it as a span of
+// the stage's name when tracing. Meant for coarse scopes (a frame, a triangle pass, a gif
+// block), not per-pixel or per-triangle work.
+class ScopedTimer
+{
+private:
+    StatsTimer _timer;
+    bool _active;
+    std::chrono::steady_clock::time_point _start;
+
+public:
+    explicit ScopedTimer(StatsTimer timer) : _timer(timer), _active(stats().enabled || trace_enabled())
+    {
+        if (_active)
+        {
+            _start = std::chrono::steady_clock::now();
+        }
+    }
+
+    ~ScopedTimer()
+    {
+        if (!_active)
+        {
+            return;
+        }
+        uint64_t elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - _start).count();
+        if (stats().enabled)
+        {
+            stats().nanoseconds[_timer].fetch_add(elapsed, std::memory_order_relaxed);
+            stats().calls[_timer].fetch_add(1, std::memory_order_relaxed);
+        }
+        if (trace_enabled())
+        {
+            uint64_t start = std::chrono::duration_cast<std::chrono::nanoseconds>(_start - trace_recorder().epoch).count();
+            trace_record(stats_timer_name(_timer), start, elapsed, -1);
+        }
+    }
+
+    ScopedTimer(const ScopedTimer &) = delete;
+    ScopedTimer &operator=(const ScopedTimer &) = delete;
+};
+
+inline const char *stats_counter_name(int counter)
+{
+    static const char *names[COUNTER_COUNT] = {"triangles_culled", "triangles_drawn", "pixels_shaded", "bytes_written"};
+    return names[counter];
+}
+
+// Summary of the recorded stats as an aligned table or a JSON object. The table also sums
+// the stages of the render thread (parse to raster) and of the encoder thread (palette to
+// io): whichever side is larger bounds the run.
+inline std::string stats_report(bool json)
+{
+    Stats &s = stats();
+    std::string out;
+    char line[128];
+    if (json)
+    {
+        out += "{\"timers\": {";
+        for (int i = 0; i < TIMER_COUNT; i++)
+        {
+            snprintf(line, sizeof(line), "%s\"%s\": {\"ms\": %.3f, \"calls\": %llu}", i ? ", " : "", stats_timer_name(i),
+                     s.nanoseconds[i] / 1e6, (unsigned long long)s.calls[i]);
+            out += line;
+        }
+        out += "}, \"counters\": {";
+        for (int i = 0; i < COUNTER_COUNT; i++)
+        {
+            snprintf(line, sizeof(line), "%s\"%s\": %llu", i ? ", " : "", stats_counter_name(i), (unsigned long long)s.counters[i]);
+            out += line;
+        }
+        out += "}}";
+        return out;
+    }
+
+    double render_ms = 0;
+    double encode_ms = 0;
+    out += "stage              calls     total ms    ms/call\n";
+    for (int i = 0; i < TIMER_COUNT; i++)
+    {
+        uint64_t calls = s.calls[i];
+        double ms = s.nanoseconds[i] / 1e6;
+        snprintf(line, sizeof(line), "%-14s %9llu %12.3f %10.4f\n", stats_timer_name(i), (unsigned long long)calls, ms, calls ? ms / calls : 0.0);
+        out += line;
+        if (i <= TIMER_RASTER)
+        {
+            render_ms += ms;
+        }
+        else if (i >= TIMER_PALETTE)
+        {
+            encode_ms += ms;
+        }
+    }
+    snprintf(line, sizeof(line), "render thread %.3f ms, encoder thread %.3f ms\n", render_ms, encode_ms);
+    out += line;
+    for (int i = 0; i < COUNTER_COUNT; i++)
+    {
+        snprintf(line, sizeof(line), "%-18s %llu\n", stats_counter_name(i), (unsigned long long)s.counters[i]);
+        out += line;
+    }
+    out.pop_back();
+    return out;
+}
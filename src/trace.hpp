@@ -0,0 +1,174 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Timeline of spans per thread, written as a Chrome trace-event JSON file that loads in
+// about:tracing or ui.perfetto.dev. Each thread records into its own fixed size ring
+// buffer: recording never locks or allocates after a thread's first span, and when a
+// buffer fills up the oldest spans are overwritten. Off until trace_enable().
+struct TraceEvent
+{
+    // string literal
+    const char *name;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    // frame number, or -1
+    int frame;
+};
+
+const size_t TRACE_BUFFER_EVENTS = 1 << 16;
+
+struct TraceBuffer
+{
+    int thread_id;
+    std::string thread_name;
+    std::vector<TraceEvent> events;
+    // spans recorded so far; only the owning thread writes it
+    std::atomic<uint64_t> recorded;
+
+    explicit TraceBuffer(int id) : thread_id(id), events(TRACE_BUFFER_EVENTS), recorded(0) {}
+};
+
+struct TraceRecorder
+{
+    bool enabled = false;
+    std::chrono::steady_clock::time_point epoch;
+    // registered on each thread's first span, read back once the threads are done
+    std::mutex buffers_mutex;
+    std::vector<std::unique_ptr<TraceBuffer>> buffers;
+};
+
+inline TraceRecorder &trace_recorder()
+{
+    static TraceRecorder instance;
+    return instance;
+}
+
+// must be called before any thread that records spans is started
+inline void trace_enable()
+{
+    trace_recorder().epoch = std::chrono::steady_clock::now();
+    trace_recorder().enabled = true;
+}
+
+inline bool trace_enabled()
+{
+    return trace_recorder().enabled;
+}
+
+inline uint64_t trace_now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - trace_recorder().epoch).count();
+}
+
+inline TraceBuffer &trace_thread_buffer()
+{
+    thread_local TraceBuffer *buffer = nullptr;
+    if (!buffer)
+    {
+        TraceRecorder &recorder = trace_recorder();
+        std::lock_guard<std::mutex> lock(recorder.buffers_mutex);
+        recorder.buffers.push_back(std::unique_ptr<TraceBuffer>(new TraceBuffer((int)recorder.buffers.size() + 1)));
+        buffer = recorder.buffers.back().get();
+    }
+    return *buffer;
+}
+
+// names the calling thread's track in the trace viewer
+inline void trace_thread_name(const char *name)
+{
+    if (trace_enabled())
+    {
+        trace_thread_buffer().thread_name = name;
+    }
+}
+
+inline void trace_record(const char *name, uint64_t start_ns, uint64_t duration_ns, int frame)
+{
+    TraceBuffer &buffer = trace_thread_buffer();
+    uint64_t n = buffer.recorded.load(std::memory_order_relaxed);
+    buffer.events[n % TRACE_BUFFER_EVENTS] = TraceEvent{name, start_ns, duration_ns, frame};
+    buffer.recorded.store(n + 1, std::memory_order_release);
+}
+
+// Records the time from construction to destruction as a span named name (a literal)
+class ScopedTrace
+{
+private:
+    const char *_name;
+    int _frame;
+    bool _active;
+    uint64_t _start_ns = 0;
+
+public:
+    explicit ScopedTrace(const char *name, int frame = -1) : _name(name), _frame(frame), _active(trace_enabled())
+    {
+        if (_active)
+        {
+            _start_ns = trace_now_ns();
+        }
+    }
+
+    ~ScopedTrace()
+    {
+        if (_active)
+        {
+            trace_record(_name, _start_ns, trace_now_ns() - _start_ns, _frame);
+        }
+    }
+
+    ScopedTrace(const ScopedTrace &) = delete;
+    ScopedTrace &operator=(const ScopedTrace &) = delete;
+};
+
+// Writes every thread's spans as trace-event JSON. Call once the recording threads are done.
+inline bool trace_write(const std::string &filename, std::string &error)
+{
+    FILE *f = fopen(filename.c_str(), "w");
+    if (!f)
+    {
+        error = "cannot open file: " + filename;
+        return false;
+    }
+    TraceRecorder &recorder = trace_recorder();
+    std::lock_guard<std::mutex> lock(recorder.buffers_mutex);
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    bool first = true;
+    for (const std::unique_ptr<TraceBuffer> &buffer : recorder.buffers)
+    {
+        if (!buffer->thread_name.empty())
+        {
+            fprintf(f, "%s{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    first ? "" : ",\n", buffer->thread_id, buffer->thread_name.c_str());
+            first = false;
+        }
+        uint64_t recorded = buffer->recorded.load(std::memory_order_acquire);
+        uint64_t begin = recorded > TRACE_BUFFER_EVENTS ? recorded - TRACE_BUFFER_EVENTS : 0;
+        for (uint64_t i = begin; i < recorded; i++)
+        {
+            const TraceEvent &event = buffer->events[i % TRACE_BUFFER_EVENTS];
+            // timestamps are in microseconds
+            fprintf(f, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f",
+                    first ? "" : ",\n", event.name, buffer->thread_id, event.start_ns / 1e3, event.duration_ns / 1e3);
+            if (event.frame >= 0)
+            {
+                fprintf(f, ", \"args\": {\"frame\": %d}", event.frame);
+            }
+            fprintf(f, "}");
+            first = false;
+        }
+    }
+    fprintf(f, "\n]}\n");
+    if (fclose(f) != 0)
+    {
+        error = "failed writing " + filename;
+        return false;
+    }
+    return true;
+}
@@ -1,7 +1,9 @@
 #pragma once
 #include <iostream>
 
-#define Log(x) std::cout << x << std::endl
+// logs go to stderr, stdout may be carrying the gif; no std::endl, stderr is unbuffered
+// already and an explicit flush per line only adds work
+#define Log(x) std::cerr << x << '\n'
 
 namespace util {   
     inline float roundf(float i)
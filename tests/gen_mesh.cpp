@@ -0,0 +1,124 @@
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+
+// Writes the procedural test meshes. Each one covers a part of the OBJ loader that the bundled
+// models do not: quads, polygons fanned into triangles and negative (relative) indices.
+//   gen_mesh cube <out.obj>     8 vertices and 6 quads
+//   gen_mesh sphere <out.obj>   UV sphere of quads and pole triangles with normals, every
+//                               index negative
+//   gen_mesh prism <out.obj>    prism whose caps are single 24-gons
+namespace
+{
+    const double PI = 3.14159265358979323846;
+
+    void write_cube(FILE *out)
+    {
+        fprintf(out, "# cube\n");
+        for (int i = 0; i < 8; i++)
+        {
+            fprintf(out, "v %d %d %d\n", i & 1 ? 1 : -1, i & 2 ? 1 : -1, i & 4 ? 1 : -1);
+        }
+        fprintf(out,
+                "f 3 4 2 1\n"
+                "f 6 8 7 5\n"
+                "f 2 6 5 1\n"
+                "f 4 8 6 2\n"
+                "f 3 7 8 4\n"
+                "f 1 5 7 3\n");
+    }
+
+    void write_sphere(FILE *out)
+    {
+        const int rings = 12;
+        const int segments = 24;
+        fprintf(out, "# uv sphere, %d rings of %d segments\n", rings, segments);
+        // the poles, then rings - 1 rings of vertices from top to bottom
+        int count = 2 + (rings - 1) * segments;
+        fprintf(out, "v 0 1 0\nvn 0 1 0\nv 0 -1 0\nvn 0 -1 0\n");
+        for (int r = 1; r < rings; r++)
+        {
+            double theta = PI * r / rings;
+            for (int s = 0; s < segments; s++)
+            {
+                double phi = 2 * PI * s / segments;
+                double x = sin(theta) * cos(phi), y = cos(theta), z = sin(theta) * sin(phi);
+                fprintf(out, "v %.6f %.6f %.6f\nvn %.6f %.6f %.6f\n", x, y, z, x, y, z);
+            }
+        }
+        // vertex k (from 0) is -(count - k) once every vertex is written
+        auto ring = [&](int r, int s) { return 2 + (r - 1) * segments + (s % segments) - count; };
+        const int top = -count, bottom = 1 - count;
+        for (int s = 0; s < segments; s++)
+        {
+            fprintf(out, "f %d//%d %d//%d %d//%d\n", top, top, ring(1, s + 1), ring(1, s + 1), ring(1, s), ring(1, s));
+            for (int r = 1; r < rings - 1; r++)
+            {
+                int a = ring(r, s), b = ring(r, s + 1), c = ring(r + 1, s + 1), d = ring(r + 1, s);
+                fprintf(out, "f %d//%d %d//%d %d//%d %d//%d\n", a, a, b, b, c, c, d, d);
+            }
+            fprintf(out, "f %d//%d %d//%d %d//%d\n", bottom, bottom, ring(rings - 1, s), ring(rings - 1, s), ring(rings - 1, s + 1), ring(rings - 1, s + 1));
+        }
+    }
+
+    void write_prism(FILE *out)
+    {
+        const int sides = 24;
+        fprintf(out, "# prism with %d-gon caps\n", sides);
+        for (int cap = 0; cap < 2; cap++)
+        {
+            for (int s = 0; s < sides; s++)
+            {
+                double phi = 2 * PI * s / sides;
+                fprintf(out, "v %.6f %.6f %.6f\n", cos(phi), cap ? 0.6 : -0.6, sin(phi));
+            }
+        }
+        fprintf(out, "f");
+        for (int s = 0; s < sides; s++)
+        {
+            fprintf(out, " %d", s + 1);
+        }
+        fprintf(out, "\nf");
+        for (int s = sides - 1; s >= 0; s--)
+        {
+            fprintf(out, " %d", sides + s + 1);
+        }
+        fprintf(out, "\n");
+        for (int s = 0; s < sides; s++)
+        {
+            int next = (s + 1) % sides;
+            fprintf(out, "f %d %d %d %d\n", s + 1, sides + s + 1, sides + next + 1, next + 1);
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "usage: gen_mesh cube|sphere|prism <out.obj>\n");
+        return 1;
+    }
+    void (*write)(FILE *) = !strcmp(argv[1], "cube")     ? write_cube
+                            : !strcmp(argv[1], "sphere") ? write_sphere
+                            : !strcmp(argv[1], "prism")  ? write_prism
+                                                         : nullptr;
+    if (!write)
+    {
+        fprintf(stderr, "unknown mesh: %s\n", argv[1]);
+        return 1;
+    }
+    FILE *out = fopen(argv[2], "w");
+    if (!out)
+    {
+        fprintf(stderr, "cannot write %s\n", argv[2]);
+        return 1;
+    }
+    write(out);
+    if (fclose(out) != 0)
+    {
+        fprintf(stderr, "failed writing %s\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,17 @@
+# Records GOLDEN again by running OBJ2GIF with ARGS, keeping the max_ms limits it had, which
+# are added by hand.
+#   cmake -DOBJ2GIF=<obj2gif> -DGOLDEN=<file> -DARGS=<arg|arg|...> -P record_golden.cmake
+string(REPLACE "|" ";" ARGS "${ARGS}")
+set(limits "")
+if(EXISTS "${GOLDEN}")
+    file(STRINGS "${GOLDEN}" limits REGEX "^max_ms ")
+    file(REMOVE "${GOLDEN}")
+endif()
+execute_process(COMMAND "${OBJ2GIF}" ${ARGS} --golden "${GOLDEN}" RESULT_VARIABLE result OUTPUT_QUIET)
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "recording ${GOLDEN} failed")
+endif()
+foreach(limit ${limits})
+    file(APPEND "${GOLDEN}" "${limit}\n")
+endforeach()
+message(STATUS "Recorded ${GOLDEN}")
@@ -0,0 +1,215 @@
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <utime.h>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include "model_cache.hpp"
+#include "obj2gif.hpp"
+#include "result_cache.hpp"
+#include "server.hpp"
+
+// Tests of the render daemon and its caches, which the golden renders through the command
+// line do not reach. The mode picks one; each works in files named after <prefix>.
+//   service_test server <model.obj> <prefix>
+//   service_test result_cache <model.obj> <prefix>
+//   service_test model_cache <model.obj> <prefix>
+namespace
+{
+    int failures = 0;
+
+    void check(bool condition, const std::string &what)
+    {
+        if (!condition)
+        {
+            fprintf(stderr, "FAILED: %s\n", what.c_str());
+            failures++;
+        }
+    }
+
+    RenderSpec small_spec(const std::string &model)
+    {
+        RenderSpec spec;
+        spec.model_file = model;
+        spec.width = spec.height = 64;
+        spec.frames = 8;
+        spec.axis = Vec3f(1, 0.3f, 0);
+        return spec;
+    }
+
+    std::vector<uint8_t> render(const RenderSpec &spec)
+    {
+        std::string error;
+        Renderer renderer;
+        std::shared_ptr<const PreparedModel> model = PreparedModel::load(spec, error);
+        std::vector<uint8_t> gif;
+        bool ok = model && renderer.configure(spec, error) &&
+                  renderer.render_gif(*model, [&gif](const uint8_t *data, size_t size) { gif.insert(gif.end(), data, data + size); return true; }, error);
+        check(ok, "render " + spec.model_file + ": " + error);
+        return gif;
+    }
+
+    bool copy_file(const std::string &from, const std::string &to)
+    {
+        std::ifstream in(from, std::ios::binary);
+        std::ofstream out(to, std::ios::binary);
+        out << in.rdbuf();
+        return in && out.flush();
+    }
+
+    // sends one request line and reads the whole response
+    std::string request(const std::string &socket_path, const std::string &line)
+    {
+        sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        memcpy(address.sun_path, socket_path.c_str(), socket_path.size());
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        // the server starts listening on its own thread
+        for (int attempt = 0; connect(fd, (const sockaddr *)&address, sizeof(address)) != 0; attempt++)
+        {
+            if (attempt == 100)
+            {
+                close(fd);
+                return "";
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        }
+        std::string text = line + "\n";
+        check(send(fd, text.data(), text.size(), 0) == (ssize_t)text.size(), "send request");
+        std::string response;
+        char buffer[4096];
+        ssize_t n;
+        while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        {
+            response.append(buffer, (size_t)n);
+        }
+        close(fd);
+        return response;
+    }
+
+    bool starts_with(const std::string &text, const std::string &prefix)
+    {
+        return text.compare(0, prefix.size(), prefix) == 0;
+    }
+
+    void test_server(const std::string &model, const std::string &prefix)
+    {
+        // socket paths are limited to about 100 bytes, so the socket goes to /tmp
+        std::string socket_path = "/tmp/obj2gif_test_" + std::to_string(getpid()) + ".sock";
+        RenderSpec defaults = small_spec("");
+        std::thread([defaults, socket_path]
+                    {
+                        std::string error;
+                        run_server(defaults, socket_path, error);
+                        fprintf(stderr, "FAILED: run_server: %s\n", error.c_str());
+                        _exit(1);
+                    })
+            .detach();
+
+        std::string response = request(socket_path, "{\"model\": \"" + model + "\"}");
+        std::vector<uint8_t> expected = render(small_spec(model));
+        check(response == "OK\n" + std::string(expected.begin(), expected.end()), "valid request returns the gif a local render writes");
+
+        response = request(socket_path, "{\"model\": \"" + model + "\", \"frames\": ");
+        check(starts_with(response, "ERROR "), "malformed request is answered with an error, got: " + response.substr(0, 40));
+        response = request(socket_path, "{\"model\": \"" + model + "\", \"output\": \"" + prefix + ".gif\"}");
+        check(starts_with(response, "ERROR "), "output key is rejected");
+        response = request(socket_path, "{\"model\": \"" + model + "\", \"lod_cache\": true}");
+        check(starts_with(response, "ERROR "), "lod_cache key is rejected");
+        response = request(socket_path, "{\"model\": \"" + model + "\", \"frames\": 100000}");
+        check(starts_with(response, "ERROR "), "oversized request is rejected");
+        struct stat st;
+        check(stat((prefix + ".gif").c_str(), &st) != 0, "rejected request wrote no output file");
+
+        response = request(socket_path, "metrics");
+        check(starts_with(response, "OK\n{\"requests\": 6, \"failed\": 4,"), "metrics count the requests, got: " + response.substr(0, 60));
+        unlink(socket_path.c_str());
+    }
+
+    void test_result_cache(const std::string &model, const std::string &prefix)
+    {
+        std::string dir = prefix + "_results";
+        mkdir(dir.c_str(), 0755);
+        ResultCache results(dir, 1 << 20);
+
+        // a still model collapses into one frame spanning all 8, a turning one keeps its frames
+        for (float end_angle : {0.0f, 360.0f})
+        {
+            RenderSpec spec = small_spec(model);
+            spec.end_angle = end_angle;
+            spec.delay = 4;
+            std::vector<uint8_t> rendered = render(spec);
+            std::string key, error;
+            check(results.key(spec, key, error), "result key: " + error);
+            check(results.store(key, spec.delay, rendered, error), "store: " + error);
+
+            std::vector<uint8_t> loaded;
+            check(results.load(key, 4, loaded) && loaded == rendered, "hit at the stored delay returns the stored gif");
+            // rescaled delays must match a gif rendered at that delay, merged frames included
+            spec.delay = 10;
+            std::string rescaled_key;
+            check(results.key(spec, rescaled_key, error) && rescaled_key == key, "the delay is not part of the key");
+            check(results.load(key, 10, loaded) && loaded == render(spec), "hit at another delay matches a render at that delay");
+        }
+    }
+
+    void test_model_cache(const std::string &model, const std::string &prefix)
+    {
+        std::string copy = prefix + ".obj";
+        check(copy_file(model, copy), "copy " + model);
+        RenderSpec spec = small_spec(copy);
+        ModelCache cache(64 << 20);
+        std::string error;
+        bool hit = true;
+        std::shared_ptr<const PreparedModel> first = cache.get(spec, error, &hit);
+        check(first && !hit, "first get loads the model");
+        std::shared_ptr<const PreparedModel> second = cache.get(spec, error, &hit);
+        check(second == first && hit, "second get is a hit");
+
+        // a new modification time alone, same size, must reload the file
+        struct stat st;
+        check(stat(copy.c_str(), &st) == 0, "stat " + copy);
+        utimbuf times = {st.st_atime, st.st_mtime + 10};
+        check(utime(copy.c_str(), &times) == 0, "touch " + copy);
+        std::shared_ptr<const PreparedModel> reloaded = cache.get(spec, error, &hit);
+        check(reloaded && reloaded != first && !hit, "a changed mtime reloads the model");
+        ModelCache::Metrics metrics = cache.metrics();
+        check(metrics.hits == 1 && metrics.misses == 2 && metrics.entries == 1, "metrics count one hit, two misses and one entry");
+        unlink(copy.c_str());
+    }
+}
+
+int main(int argc, char **argv)
+{
+    if (argc != 4)
+    {
+        fprintf(stderr, "usage: service_test server|result_cache|model_cache <model.obj> <prefix>\n");
+        return 1;
+    }
+    std::string mode = argv[1];
+    if (mode == "server")
+    {
+        test_server(argv[2], argv[3]);
+    }
+    else if (mode == "result_cache")
+    {
+        test_result_cache(argv[2], argv[3]);
+    }
+    else if (mode == "model_cache")
+    {
+        test_model_cache(argv[2], argv[3]);
+    }
+    else
+    {
+        fprintf(stderr, "unknown mode: %s\n", mode.c_str());
+        return 1;
+    }
+    return failures == 0 ? 0 : 1;
+}